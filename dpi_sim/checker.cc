@@ -41,6 +41,11 @@ void dpisim_t::check_double(reg_t micro0, reg_t micro1, reg_t isa0, reg_t isa1,
 }
 
 bool dpisim_t::check_state(state_t* micro_state, state_t* isa_state, db_t* actual) {
+   return check_state(micro_state, isa_state, actual, cycle, num_insn, disassembler);
+}
+
+bool dpisim_t::check_state(state_t* micro_state, state_t* isa_state, db_t* actual,
+                           cycle_t at_cycle, uint64_t at_insn, disassembler_t* disasm) {
    bool fail = false;
 
    //if(micro_state->epc               !=  isa_state->epc              ) fail = true;
@@ -66,10 +71,10 @@ bool dpisim_t::check_state(state_t* micro_state, state_t* isa_state, db_t* actua
         //PAY.dump(this, PAY.head, stderr);
         micro_state->dump(stderr);
         fprintf(stderr,"\nState for isa_sim:\n");
-        pipe->dump(this, actual, stderr);
+        pipe->dump(disasm, at_cycle, actual, stderr);
       #endif
       isa_state->dump(stderr);
-      printf("Instruction %.0f, Cycle %.0f: State check failed.\n", (double)num_insn, (double)cycle);
+      printf("Instruction %.0f, Cycle %.0f: State check failed.\n", (double)at_insn, (double)at_cycle);
       //assert(0);
    }
 
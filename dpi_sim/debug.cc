@@ -19,23 +19,24 @@
 #include "sim.h"
 //#include "processor.h"
 #include "dpisim.h"
+#include "disasm.h"
+#include "trace.h"
 extern bool logging_on;
 
-// Checks to see if index 'e' lies between 'head' and 'tail'.
+// Checks to see if index 'e' lies between 'head' and the last published entry.
 bool debug_buffer_t::is_active(unsigned int e) {
-   if (length > 0) {
-      if (head <= tail)
-         return((e >= head) && (e <= tail));
-      else
-         return((e >= head) || (e <= tail));
-   }
-   else {
-      return(false);
-   }
+   unsigned int n = length();
+   return(MOD((e + DEBUG_SIZE - head), DEBUG_SIZE) < n);
 }
 
 
-debug_buffer_t::debug_buffer_t(unsigned int window_size) {
+debug_buffer_t::debug_buffer_t(unsigned int window_size)
+  : debug_buffer_t(window_size, 0) {
+}
+
+debug_buffer_t::debug_buffer_t(unsigned int window_size, unsigned int _proc_id) {
+   proc_id = _proc_id;
+
    // Set the full size and active size of the debug buffer.
    // Both had better be a power of two.
    // DEBUG_SIZE = 4*window_size;
@@ -56,13 +57,73 @@ debug_buffer_t::debug_buffer_t(unsigned int window_size) {
    // Initialize debug buffer.
    head = 0;
    tail = (DEBUG_SIZE - 1);
-   length = 0;
+   started = 0;
+   published = 0;
+   popped = 0;
+   producer_run = false;
 
    pc_ptr = 0;
    inst_sequence = 0;
 }
 
 debug_buffer_t::~debug_buffer_t() {
+  stop_producer();
+}
+
+// A single-core functional simulator is stepped through sim_t::step() so
+// that HTIF ticks stay interleaved exactly as before. With multiple harts
+// every hart has its own debug buffer, and only the core feeding this
+// buffer is advanced.
+bool debug_buffer_t::step_isa_sim(){
+  bool htif_return;
+  if(isa_sim->num_cores() == 1)
+    htif_return = isa_sim->step(1);
+  else
+    htif_return = isa_sim->step_proc(proc_id);
+
+  // The instruction has finished executing, so its entry is complete.
+  published.store(started, std::memory_order_release);
+  return htif_return;
+}
+
+void debug_buffer_t::producer_loop(){
+  while(producer_run.load(std::memory_order_acquire) && isa_sim->running()){
+    if(hungry())
+      step_isa_sim();
+    else
+      std::this_thread::yield();
+  }
+  producer_run.store(false, std::memory_order_release);
+}
+
+void debug_buffer_t::start_producer(){
+  if(producer.joinable())
+    return;
+  ifprintf(logging_on,stderr, "Starting functional simulator run-ahead thread\n");
+  producer_run = true;
+  producer = std::thread(&debug_buffer_t::producer_loop, this);
+}
+
+void debug_buffer_t::stop_producer(){
+  producer_run = false;
+  if(producer.joinable())
+    producer.join();
+}
+
+void debug_buffer_t::wait_for_entry(){
+  while(empty()){
+    // Without a run-ahead thread, refill in the caller.
+    if(!producer.joinable()){
+      if(!isa_sim->running())
+        break;
+      step_isa_sim();
+    }
+    // The run-ahead thread has stopped and nothing more will arrive.
+    else if(!producer_run.load(std::memory_order_acquire) && empty())
+      break;
+    else
+      std::this_thread::yield();
+  }
 }
 
 bool debug_buffer_t::run_ahead(){
@@ -76,7 +137,7 @@ bool debug_buffer_t::run_ahead(){
   isa_sim->set_procs_checker(true);
   while(hungry() && htif_return){
     ifprintf(logging_on,stderr, "Functional simulator hungry\n");
-    htif_return = isa_sim->step(1);
+    htif_return = step_isa_sim();
   }
 
   return htif_return;
@@ -94,16 +155,17 @@ void debug_buffer_t::skip_till_pc(reg_t pc, unsigned int proc_id){
 }
 
 void debug_buffer_t::start() {
-   // Check for overflow and maintain 'length'.
-   assert(length < ACTIVE_SIZE);
-   length += 1;
+   // Check for overflow. The entry is not visible to the consumer
+   // until it is published at the end of the step.
+   assert((started - popped.load(std::memory_order_acquire)) < ACTIVE_SIZE);
+   started += 1;
 
    // Initialize a new debug entry.
    tail = MOD((tail + 1), DEBUG_SIZE);
 
    assert(db[tail].entry_id == tail);
 
-   db[head].a_valid = true;
+   db[tail].a_valid = true;
    db[tail].a_exception   = false;
    db[tail].a_num_rdst = 0;
    db[tail].a_num_rsrc = 0;
@@ -116,7 +178,7 @@ void debug_buffer_t::start() {
    for(unsigned int i=0;i<D_MAX_RDST;i++)
      db[tail].a_rdst[i].valid = 0;
 
-   ifprintf(logging_on,stderr, "Starting debug buffer entry %u\n",tail);
+   TRACE(TE_DB_START, proc_id, tail, 0, 0, 0);
 }
 
 void debug_buffer_t::push_operand_actual( unsigned int n, operand_t t, reg_t value, reg_t pc) 
@@ -124,7 +186,7 @@ void debug_buffer_t::push_operand_actual( unsigned int n, operand_t t, reg_t val
                           
     unsigned int i;
 
-    ifprintf(logging_on,stderr,"Pushing operand type: %u to entry %u\n",t,tail);                          
+    TRACE(TE_DB_PUSH_OPERAND, proc_id, tail, t, 0, 0);
    switch (t) {
       case RDST_OPERAND:
         // Push RS1 if not already pushed
@@ -193,7 +255,7 @@ void debug_buffer_t::push_address_actual( reg_t addr,
 			                    unsigned int real_lower) {
 
    assert(t == MSRC_OPERAND || t == MDST_OPERAND);
-   ifprintf(logging_on,stderr,"Pushing operand type: %u to entry %u addr %lu\n",t,tail,addr);                          
+   TRACE(TE_DB_PUSH_ADDR, proc_id, tail, t, addr, 0);
    db[tail].a_addr = addr;
 
    db[tail].real_upper = real_upper;
@@ -300,7 +362,7 @@ void debug_buffer_t::push_state_actual(state_t* a_state_ptr,bool checkpoint_stat
 // that entry.
 db_t* debug_buffer_t::pop(debug_index_t i) {
 
-   ifprintf(logging_on,stderr, "Timing simulator popping entry %u\n",i);
+   TRACE(TE_DB_POP, proc_id, i, 0, 0, 0);
    assert(i == head);
 
    // Set the valid bit to 0 so that perfect branch prediction
@@ -309,20 +371,22 @@ db_t* debug_buffer_t::pop(debug_index_t i) {
    db[head].a_valid = false;
 
 
-   // Fill out the debug buffer
+   // Fill out the debug buffer, unless the run-ahead thread does it.
    // Make sure the simulator is still running and is not already 
    // done with the program.
-   while(hungry() && isa_sim->running()){
-    ifprintf(logging_on,stderr, "Functional simulator hungry\n");
-     isa_sim->step(1);
+   if(!producer.joinable()){
+     while(hungry() && isa_sim->running()){
+      ifprintf(logging_on,stderr, "Functional simulator hungry\n");
+       step_isa_sim();
+     }
    }
 
-   // Check for underflow and maintain 'length'.
-   assert(length > 0);
-   length -= 1;
+   // Check for underflow.
+   assert(length() > 0);
 
    // Pop the head entry by advancing head pointer.
    head = MOD((head + 1), DEBUG_SIZE);
+   popped.fetch_add(1, std::memory_order_release);
 
 
    // Return a pointer to (what was) the head entry.
@@ -373,7 +437,14 @@ debug_index_t debug_buffer_t::find(debug_index_t i, reg_t pc) {
 
 void debug_buffer_t::dump(dpisim_t* proc, db_t* actual, FILE* file)
 {
-  proc->disasm(actual->a_inst,proc->cycle,actual->a_pc,actual->a_sequence,file);
+  dump(proc->get_disassembler(), proc->cycle, actual, file);
+}
+
+void debug_buffer_t::dump(disassembler_t* disassembler, cycle_t cycle, db_t* actual, FILE* file)
+{
+  uint64_t bits = actual->a_inst.bits() & ((1ULL << (8 * insn_length(actual->a_inst.bits()))) - 1);
+  ifprintf(logging_on,file, "Cycle %" PRIcycle ": Seq %" PRIu64 " PC 0x%016" PRIx64 " (0x%08" PRIx64 ") %s\n",
+          cycle, actual->a_sequence, actual->a_pc, bits, disassembler->disassemble(actual->a_inst).c_str());
   ifprintf(logging_on,file,"next_pc    : %" PRIxreg "\t",  actual->a_next_pc);
   ifprintf(logging_on,file,"Mem addr   : %" PRIxreg "\t",  actual->a_addr);
   ifprintf(logging_on,file,"entry_id   : %" PRIu64  "\t",  actual->entry_id);
@@ -19,6 +19,8 @@
 
 #include <cstdio>
 #include <cassert>
+#include <atomic>
+#include <thread>
 #include "common.h"
 #include "decode.h"
 
@@ -104,6 +106,7 @@ typedef unsigned int	debug_index_t;
 
 class sim_t;
 class dpisim_t;
+class disassembler_t;
 
 class debug_buffer_t {
 
@@ -116,9 +119,21 @@ private:
 	unsigned int ACTIVE_SIZE;
 
 	db_t* db;
-	debug_index_t head;
-	debug_index_t tail;
-	unsigned int  length;
+
+	// The buffer is a single-producer/single-consumer ring. The functional
+	// simulator (producer) owns 'tail' and 'started', the timing simulator
+	// (consumer) owns 'head'. The free-running counts 'published' and
+	// 'popped' are the only state shared between the two, so the producer
+	// may run on its own thread without locks.
+	debug_index_t head;   // oldest entry, consumer side
+	debug_index_t tail;   // entry under construction, producer side
+	uint64_t      started;                 // entries started by the producer
+	std::atomic<uint64_t> published;       // entries complete and visible to the consumer
+	std::atomic<uint64_t> popped;          // entries released by the consumer
+
+	// Run-ahead thread that keeps the buffer full.
+	std::thread       producer;
+	std::atomic<bool> producer_run;
 
   uint64_t    inst_sequence;
 
@@ -126,33 +141,59 @@ private:
 	debug_index_t pc_ptr;	// used by pop_pc()
 
   sim_t* isa_sim;
+  unsigned int proc_id; // core of isa_sim that feeds this buffer
 
   ///////////////////////
   // PRIVATE FUNCTIONS
   ///////////////////////
 
-  // Checks to see if index 'e' lies between 'head' and 'tail'.
+  // Checks to see if index 'e' lies in the published part of the buffer.
   bool is_active(unsigned int e);
 
+  // Advance the functional simulator by one instruction and publish
+  // the entry it produced.
+  bool step_isa_sim();
+
+  // Body of the run-ahead thread.
+  void producer_loop();
+
+  // Block until the buffer holds at least one entry.
+  void wait_for_entry();
+
+  inline unsigned int length() {
+    return (unsigned int)(published.load(std::memory_order_acquire) - popped.load(std::memory_order_relaxed));
+  }
+
 public:
 	///////////////
 	// INTERFACE
 	///////////////
 
 	debug_buffer_t(unsigned int window_size);
+	debug_buffer_t(unsigned int window_size, unsigned int _proc_id);
 	~debug_buffer_t();
 
   void set_isa_sim(sim_t* _isa_sim){ isa_sim = _isa_sim; }
+  unsigned int get_proc_id(){ return proc_id; }
   bool run_ahead();
   void skip_till_pc(reg_t pc, unsigned int proc_id);
 
+  // Run the functional simulator on its own thread so that it fills the
+  // buffer while the timing simulator runs. Once started, the consumer
+  // never steps isa_sim itself; it only waits when the buffer is empty.
+  void start_producer();
+  void stop_producer();
+
 	//////////////////////////////////////////////////////////////
 	// Interface for collecting functional simulator state.
 	//////////////////////////////////////////////////////////////
 
+	// One slot is held back for the entry most recently returned by pop(),
+	// which the consumer may still be reading.
 	inline	bool hungry() {
-    ifprintf(logging_on,stderr, "Debug buffer head: %u tail %u length %u active size %u\n",head,tail,length,ACTIVE_SIZE);
-	  return(length < ACTIVE_SIZE);
+    uint64_t in_use = started - popped.load(std::memory_order_acquire);
+    ifprintf(logging_on,stderr, "Debug buffer tail %u in use %" PRIu64 " active size %u\n",tail,in_use,ACTIVE_SIZE);
+	  return(in_use < (ACTIVE_SIZE - 1));
 	}
 
 	void start();
@@ -171,6 +212,7 @@ public:
 	// value equal to 'pc'.
 	// Then return the index of the head entry.
 	inline debug_index_t first(reg_t pc) {
+	   wait_for_entry();
 	   assert(pc == db[head].a_pc);
 	   return(head);
 	}
@@ -199,7 +241,7 @@ public:
 	}
 
 	inline	bool empty() {
-	   return(length == 0);
+	   return(length() == 0);
 	}
 
   db_t* pop(debug_index_t i);
@@ -253,6 +295,9 @@ public:
 
 
   void dump(dpisim_t* proc, db_t* actual, FILE* file); 
+  // Same, with the cycle and disassembler given explicitly, so that a
+  // thread other than the one stepping 'proc' can dump an entry.
+  void dump(disassembler_t* disassembler, cycle_t cycle, db_t* actual, FILE* file);
 };
 
 
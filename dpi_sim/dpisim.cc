@@ -574,8 +574,115 @@ uint64_t dpisim_t::get_arch_reg_value(int reg_id) {
 }
 
 
-uint32_t dpisim_t::get_instruction(uint64_t inst_pc){
-  //TODO: handle fetch exceptions
-  insn_fetch_t inst_raw = mmu->load_insn(inst_pc);
-  return (uint32_t)inst_raw.insn.bits();
+bool dpisim_t::get_instruction(uint64_t inst_pc, uint32_t* insn, reg_t* cause){
+  icache_entry_t* entry;
+  if (!mmu->try_access_icache(inst_pc, &entry, cause))
+    return false;
+  *insn = (uint32_t)entry->data.insn.bits();
+  return true;
+}
+
+// Classify an instruction by its major opcode.
+unsigned int dpisim_t::predecode(insn_t insn, fu_type* fu){
+  uint32_t bits = insn.bits();
+  uint32_t funct7 = bits >> 25;
+  uint32_t funct3 = (bits >> 12) & 0x7;
+
+  switch (bits & 0x7f) {
+    case 0x03: // LOAD
+      *fu = FU_LS;
+      return F_MEM | F_LOAD | F_DISP;
+    case 0x07: // LOAD-FP
+      *fu = FU_LS_FP;
+      return F_MEM | F_LOAD | F_FMEM | F_DISP;
+    case 0x23: // STORE
+      *fu = FU_LS;
+      return F_MEM | F_STORE | F_DISP;
+    case 0x27: // STORE-FP
+      *fu = FU_LS_FP;
+      return F_MEM | F_STORE | F_FMEM | F_DISP;
+    case 0x2f: // AMO
+      *fu = FU_LS;
+      return F_MEM | F_LOAD | F_STORE | F_AMO;
+    case 0x13: // OP-IMM
+    case 0x1b: // OP-IMM-32
+    case 0x17: // AUIPC
+    case 0x37: // LUI
+      *fu = FU_ALU_S;
+      return F_ICOMP;
+    case 0x33: // OP
+    case 0x3b: // OP-32
+      if (funct7 == 0x01) { // multiply/divide
+        *fu = FU_ALU_C;
+        return F_ICOMP | F_LONGLAT;
+      }
+      *fu = FU_ALU_S;
+      return F_ICOMP;
+    case 0x63: // BRANCH
+      *fu = FU_BR;
+      return F_CTRL | F_COND | F_DIRECT;
+    case 0x6f: // JAL
+      *fu = FU_BR;
+      return F_CTRL | F_UNCOND | F_DIRECT;
+    case 0x67: // JALR
+      *fu = FU_BR;
+      return F_CTRL | F_UNCOND;
+    case 0x43: // FMADD
+    case 0x47: // FMSUB
+    case 0x4b: // FNMSUB
+    case 0x4f: // FNMADD
+      *fu = FU_ALU_FP;
+      return F_FCOMP | F_LONGLAT;
+    case 0x53: // OP-FP
+      switch (funct7 >> 2) {
+        case 0x03: // FDIV
+        case 0x0b: // FSQRT
+          *fu = FU_ALU_FP;
+          return F_FCOMP | F_LONGLAT;
+        case 0x14: // FEQ/FLT/FLE
+        case 0x18: // FCVT to integer
+        case 0x1a: // FCVT from integer
+        case 0x1c: // FMV.X, FCLASS
+        case 0x1e: // FMV from integer
+          *fu = FU_MTF;
+          return F_FCOMP;
+      }
+      *fu = FU_ALU_FP;
+      return F_FCOMP;
+    case 0x73: // SYSTEM
+      *fu = FU_ALU_C;
+      return funct3 == 0 ? F_TRAP : F_CSR;
+    case 0x0f: // MISC-MEM
+      *fu = FU_ALU_S;
+      return 0;
+  }
+  *fu = FU_ALU_S;
+  return F_TRAP;
+}
+
+int dpisim_t::get_fetch_bundle(reg_t pc, int width, fetch_slot_t* slots){
+  int n = 0;
+  while (n < width) {
+    fetch_slot_t* slot = &slots[n++];
+    slot->pc = pc;
+    icache_entry_t* entry;
+    reg_t cause;
+    if (!mmu->try_access_icache(pc, &entry, &cause)) {
+      slot->insn  = 0;
+      slot->flags = 0;
+      slot->fu    = FU_ALU_S;
+      slot->rd    = slot->rs1 = slot->rs2 = 0;
+      slot->cause = cause;
+      break;
+    }
+    insn_t insn = entry->data.insn;
+    slot->insn  = insn.bits();
+    slot->flags = predecode(insn, &slot->fu);
+    slot->rd    = insn.rd();
+    slot->rs1   = insn.rs1();
+    slot->rs2   = insn.rs2();
+    slot->cause = 0;
+    pc += insn_length(insn.bits());
+  }
+  return n;
 }
@@ -148,6 +148,23 @@ extern "C" uint64_t get_csr_from_rtl(int);
 extern "C" void     set_csr_in_rtl(int, uint64_t);
 extern "C" void     end_rtl_simulation(void);
 
+// Most slots a single fetch bundle request returns.
+#define FETCH_BUNDLE_MAX 32
+
+// One slot of a fetch bundle, with the predecode information the RTL
+// fetch model would otherwise have to work out itself.
+struct fetch_slot_t
+{
+  reg_t        pc;
+  uint32_t     insn;
+  unsigned int flags;   // F_* flags
+  fu_type      fu;
+  unsigned int rd;
+  unsigned int rs1;
+  unsigned int rs2;
+  int          cause;   // fetch fault cause, 0 if none
+};
+
 // this class represents one processor in a RISC-V machine.
 class dpisim_t: public processor_t
 {
@@ -216,11 +233,21 @@ public:
   //void copy_state_to_micro();
   uint64_t get_arch_reg_value(int reg_id); 
   uint64_t get_pc(){return get_state()->pc;}
-  uint32_t get_instruction(uint64_t inst_pc);
+  // Fetch the instruction at 'inst_pc'. Returns false and sets *cause if
+  // the fetch faults.
+  bool get_instruction(uint64_t inst_pc, uint32_t* insn, reg_t* cause);
+  // Fetch up to 'width' sequential instructions starting at 'pc'. Stops
+  // after the first slot that faults. Returns the number of slots filled.
+  int get_fetch_bundle(reg_t pc, int width, fetch_slot_t* slots);
+  static unsigned int predecode(insn_t insn, fu_type* fu);
 
 	void check_single(reg_t micro, reg_t isa, db_t* actual, const char *desc);
 	void check_double(reg_t micro0, reg_t micro1, reg_t isa0, reg_t isa1, const char *desc);
   bool check_state(state_t* micro_state, state_t* isa_state, db_t* actual);
+  // Same, reporting a failure at the given cycle and instruction count
+  // instead of the current ones, for checks made off the simulation thread.
+  bool check_state(state_t* micro_state, state_t* isa_state, db_t* actual,
+                   cycle_t at_cycle, uint64_t at_insn, disassembler_t* disasm);
 
 private:
 //	sim_t* sim;
@@ -0,0 +1,327 @@
+// See LICENSE for license details.
+
+#include "lazy_mem.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#endif
+
+// Regions armed with the mprotect fallback, searched by the SIGSEGV
+// handler. Two are enough for the DPI SIM and its checker.
+static const size_t MAX_REGIONS = 4;
+static std::atomic<lazy_mem_t*> regions[MAX_REGIONS];
+static struct sigaction old_segv;
+static bool segv_installed = false;
+
+lazy_mem_t::lazy_mem_t(char* _mem, size_t _memsz)
+  : mem(_mem), memsz(_memsz), page_size(0), fd(-1), data_offset(0),
+    filled(0), uffd(-1)
+{
+  stop_pipe[0] = stop_pipe[1] = -1;
+  fill_lock.clear();
+}
+
+lazy_mem_t::~lazy_mem_t()
+{
+  if (handler.joinable())
+  {
+    char c = 0;
+    if (write(stop_pipe[1], &c, 1) != 1)
+      perror("lazy_mem_t");
+    handler.join();
+  }
+  if (uffd >= 0)
+    close(uffd);
+  for (int i = 0; i < 2; i++)
+    if (stop_pipe[i] >= 0)
+      close(stop_pipe[i]);
+
+  if (!armed.empty())
+  {
+    for (size_t i = 0; i < MAX_REGIONS; i++)
+      if (regions[i] == this)
+        regions[i] = NULL;
+    mprotect(mem, memsz, PROT_READ | PROT_WRITE);
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+bool lazy_mem_t::open(const std::string& memory_file)
+{
+  fd = ::open(memory_file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    fprintf(stderr, "lazy restore: cannot open %s: %s\n", memory_file.c_str(), strerror(errno));
+    return false;
+  }
+  if (!read_index())
+  {
+    fprintf(stderr, "lazy restore: %s is not a sparse checkpoint of this memory\n", memory_file.c_str());
+    return false;
+  }
+  // A checkpoint page (PGSIZE, 8 KiB with RV64) may span several host
+  // pages; a fault anywhere in it fills all of it.
+  size_t host_page = sysconf(_SC_PAGESIZE);
+  if (page_size % host_page || (uintptr_t)mem % host_page)
+  {
+    fprintf(stderr, "lazy restore: checkpoint pages do not match host pages\n");
+    return false;
+  }
+
+  if (arm_userfaultfd())
+    fprintf(stderr, "lazy restore: %zu pages from %s on demand (userfaultfd)\n", pages.size(), memory_file.c_str());
+  else if (arm_mprotect())
+    fprintf(stderr, "lazy restore: %zu pages from %s on demand (mprotect)\n", pages.size(), memory_file.c_str());
+  else
+    return false;
+  return true;
+}
+
+bool lazy_mem_t::read_index()
+{
+  uint64_t hdr[4]; // signature, memory size, page size, page count
+  if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+    return false;
+  if (hdr[0] != MEM_CHKPT_SPARSE_SIGNATURE || hdr[1] != memsz ||
+      hdr[2] == 0 || memsz % hdr[2] || hdr[3] > memsz / hdr[2])
+    return false;
+  page_size = hdr[2];
+
+  pages.resize(hdr[3]);
+  size_t index_bytes = pages.size() * sizeof(uint64_t);
+  if (pread(fd, pages.data(), index_bytes, sizeof(hdr)) != (ssize_t)index_bytes)
+    return false;
+  for (size_t i = 0; i < pages.size(); i++)
+    if (pages[i] >= memsz / page_size || (i && pages[i] <= pages[i-1]))
+      return false;
+  data_offset = sizeof(hdr) + index_bytes;
+  return true;
+}
+
+void lazy_mem_t::read_page(uint64_t page, char* dst)
+{
+  size_t i = std::lower_bound(pages.begin(), pages.end(), page) - pages.begin();
+  if (i == pages.size() || pages[i] != page)
+  {
+    memset(dst, 0, page_size);
+    return;
+  }
+
+  off_t off = data_offset + i * page_size;
+  for (size_t done = 0; done < page_size; )
+  {
+    ssize_t n = pread(fd, dst + done, page_size - done, off + done);
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      // There is no way to report this to whoever touched the page.
+      perror("lazy restore: checkpoint read");
+      abort();
+    }
+    done += n;
+  }
+}
+
+bool lazy_mem_t::arm_userfaultfd()
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+  uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd < 0)
+    return false;
+
+  struct uffdio_api api;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  struct uffdio_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.range.start = (uintptr_t)mem;
+  reg.range.len = memsz;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  uint64_t needed = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+
+  if (ioctl(uffd, UFFDIO_API, &api) < 0 || pipe(stop_pipe) < 0)
+  {
+    close(uffd);
+    uffd = -1;
+    return false;
+  }
+
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0 || (reg.ioctls & needed) != needed)
+  {
+    close(uffd);
+    uffd = -1;
+    return false;
+  }
+
+  // HTIF replay writes memory before the checkpoint is restored. Drop
+  // all of it so that every page faults, and is then read from the
+  // checkpoint or, if it is not listed, zero filled.
+  madvise(mem, memsz, MADV_DONTNEED);
+
+  handler = std::thread(&lazy_mem_t::handler_loop, this);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void lazy_mem_t::handler_loop()
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+  std::vector<char> buf(2 * page_size);
+  char* page_buf = &buf[0] + (page_size - (uintptr_t)&buf[0] % page_size) % page_size;
+
+  while (true)
+  {
+    struct pollfd pfd[2];
+    pfd[0].fd = uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stop_pipe[0];
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("lazy restore: poll");
+      abort();
+    }
+    if (pfd[1].revents)
+      break;
+
+    struct uffd_msg msg;
+    if (read(uffd, &msg, sizeof(msg)) != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+    uint64_t page = (msg.arg.pagefault.address - (uintptr_t)mem) / page_size;
+    uintptr_t addr = (uintptr_t)mem + page * page_size;
+
+    int ret;
+    if (std::binary_search(pages.begin(), pages.end(), page))
+    {
+      read_page(page, page_buf);
+      struct uffdio_copy copy;
+      memset(&copy, 0, sizeof(copy));
+      copy.dst = addr;
+      copy.src = (uintptr_t)page_buf;
+      copy.len = page_size;
+      // On EAGAIN, copy.copy holds the bytes already copied, if any.
+      while ((ret = ioctl(uffd, UFFDIO_COPY, &copy)) < 0 && errno == EAGAIN)
+      {
+        if (copy.copy > 0)
+        {
+          copy.dst += copy.copy;
+          copy.src += copy.copy;
+          copy.len -= copy.copy;
+        }
+        copy.copy = 0;
+      }
+      if (ret == 0)
+        filled++;
+    }
+    else
+    {
+      struct uffdio_zeropage zero;
+      memset(&zero, 0, sizeof(zero));
+      zero.range.start = addr;
+      zero.range.len = page_size;
+      while ((ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zero)) < 0 && errno == EAGAIN)
+      {
+        if (zero.zeropage > 0)
+        {
+          zero.range.start += zero.zeropage;
+          zero.range.len -= zero.zeropage;
+        }
+        zero.zeropage = 0;
+      }
+    }
+    // EEXIST: the page was resolved by an earlier message for it.
+    if (ret < 0 && errno != EEXIST)
+    {
+      perror("lazy restore: userfaultfd");
+      abort();
+    }
+  }
+#endif
+}
+
+bool lazy_mem_t::arm_mprotect()
+{
+  size_t slot = 0;
+  while (slot < MAX_REGIONS && regions[slot] != NULL)
+    slot++;
+  if (slot == MAX_REGIONS)
+    return false;
+
+  if (!segv_installed)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = &lazy_mem_t::segv_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &old_segv) < 0)
+      return false;
+    segv_installed = true;
+  }
+
+  armed.assign(memsz / page_size, 1);
+  regions[slot] = this;
+  if (mprotect(mem, memsz, PROT_NONE) < 0)
+  {
+    regions[slot] = NULL;
+    armed.clear();
+    return false;
+  }
+  return true;
+}
+
+bool lazy_mem_t::fill_protected(uintptr_t addr)
+{
+  uint64_t page = (addr - (uintptr_t)mem) / page_size;
+  bool ok = true;
+
+  while (fill_lock.test_and_set(std::memory_order_acquire))
+    ;
+  if (armed[page])
+  {
+    char* p = mem + page * page_size;
+    ok = mprotect(p, page_size, PROT_READ | PROT_WRITE) == 0;
+    if (ok)
+    {
+      // Unlisted pages may hold HTIF replay data; read_page() zeroes them.
+      read_page(page, p);
+      if (std::binary_search(pages.begin(), pages.end(), page))
+        filled++;
+    }
+    armed[page] = 0;
+  }
+  fill_lock.clear(std::memory_order_release);
+  return ok;
+}
+
+void lazy_mem_t::segv_handler(int sig, siginfo_t* info, void* ctx)
+{
+  uintptr_t addr = (uintptr_t)info->si_addr;
+  for (size_t i = 0; i < MAX_REGIONS; i++)
+  {
+    lazy_mem_t* r = regions[i];
+    if (r && addr >= (uintptr_t)r->mem && addr < (uintptr_t)r->mem + r->memsz &&
+        r->fill_protected(addr))
+      return;
+  }
+
+  // Not a lazily restored page: hand the fault back to whoever had
+  // SIGSEGV before us when the instruction is retried.
+  sigaction(SIGSEGV, &old_segv, NULL);
+}
@@ -0,0 +1,88 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_LAZY_MEM_H
+#define _RISCV_LAZY_MEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Memory checkpoints start with a signature and the memory size. The
+// legacy format follows with all of memory. The sparse format follows
+// with its page size, the number of pages that are not all zero, their
+// page numbers in ascending order and then their contents in the same
+// order. The index comes first so that lazy_mem_t can find any page
+// without reading the others. A checkpoint that uses a page store has the
+// same index followed by the content hash of each page instead of its
+// contents. The older interleaved sparse format follows its page size
+// with each page number and its contents, ending with page number
+// MEM_CHKPT_INTERLEAVED_END; it is still read, but never written.
+static const uint64_t MEM_CHKPT_SIGNATURE = 0xbaadbeefdeadbeef;
+static const uint64_t MEM_CHKPT_SPARSE_SIGNATURE = 0xbaadbeefdeadb5e1;
+static const uint64_t MEM_CHKPT_STORE_SIGNATURE = 0xbaadbeefdeadb5e5;
+static const uint64_t MEM_CHKPT_INTERLEAVED_SIGNATURE = 0xbaadbeefdeadb5ef;
+static const uint64_t MEM_CHKPT_INTERLEAVED_END = -1;
+
+// Demand-paged restore of a sparse memory checkpoint.
+//
+// open() reads only the checkpoint's page index. Each page the checkpoint
+// lists is then read from the file the first time the target memory
+// region is touched there, by anyone: the interpreter, translated code,
+// the MMU or a DPI memory window. Pages the checkpoint does not list read
+// as zero, as they do with an eager sparse restore, whatever the HTIF
+// replay wrote to them before. A checkpoint page may be any multiple of
+// the host page size and is always filled as a whole.
+//
+// Faults are served by a Linux userfaultfd handler thread. Where
+// userfaultfd is not available the region is protected with mprotect()
+// and filled from a SIGSEGV handler instead. That fallback fills a page in
+// place, so two threads must not touch the same unfilled page at once.
+class lazy_mem_t
+{
+public:
+  lazy_mem_t(char* _mem, size_t _memsz);
+  ~lazy_mem_t();
+
+  // Arm the region with the sparse checkpoint in 'memory_file'. Returns
+  // false, leaving memory untouched, if the file is not a sparse
+  // checkpoint for this memory or the host cannot page it in lazily.
+  bool open(const std::string& memory_file);
+
+  size_t pages_listed() { return pages.size(); }
+  size_t pages_filled() { return filled; }
+
+private:
+  char* mem;
+  size_t memsz;
+  size_t page_size;
+  int fd;                      // checkpoint file
+  uint64_t data_offset;        // file offset of the first listed page
+  std::vector<uint64_t> pages; // listed page numbers, ascending
+  std::atomic<size_t> filled;
+
+  // userfaultfd
+  int uffd;
+  int stop_pipe[2];
+  std::thread handler;
+
+  // mprotect fallback
+  std::vector<uint8_t> armed; // per target page, whether it is still protected
+  std::atomic_flag fill_lock;
+
+  bool read_index();
+  bool arm_userfaultfd();
+  bool arm_mprotect();
+  void handler_loop();
+  // Read page 'page' of target memory from the checkpoint into 'dst'.
+  // Pages the checkpoint does not list read as zero.
+  void read_page(uint64_t page, char* dst);
+  bool fill_protected(uintptr_t addr);
+
+  static void segv_handler(int sig, siginfo_t* info, void* ctx);
+};
+
+#endif
@@ -0,0 +1,133 @@
+// See LICENSE for license details.
+
+#include "page_store.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// MurmurHash3 x64_128, seed 0. Pages are a multiple of 16 bytes long, so
+// there is no tail to mix in.
+page_hash_t page_store_t::hash(const char* page, size_t len)
+{
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0, h2 = 0;
+
+  for (size_t i = 0; i + 16 <= len; i += 16)
+  {
+    uint64_t k1, k2;
+    memcpy(&k1, page + i, 8);
+    memcpy(&k2, page + i + 8, 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  page_hash_t h;
+  h.lo = h1;
+  h.hi = h2;
+  return h;
+}
+
+std::string page_hash_t::hex() const
+{
+  char buf[33];
+  snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+  return buf;
+}
+
+std::string page_store_t::path(const page_hash_t& h)
+{
+  std::string name = h.hex();
+  return dir + "/" + name.substr(0, 2) + "/" + name;
+}
+
+bool page_store_t::put(const page_hash_t& h, const char* page, size_t len)
+{
+  std::string name = h.hex();
+  std::string file = path(h);
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    // One byte more than a page, to catch a stored file that is longer.
+    stored.resize(len + 1);
+    ssize_t n = read(fd, &stored[0], len + 1);
+    close(fd);
+    if (n == (ssize_t)len && memcmp(&stored[0], page, len) == 0)
+      return true;
+    fprintf(stderr, "page store: %s holds a different page (hash collision or damaged store)\n",
+            file.c_str());
+    return false;
+  }
+
+  std::string subdir = dir + "/" + name.substr(0, 2);
+  mkdir(dir.c_str(), 0755);
+  if (mkdir(subdir.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "page store: cannot create %s: %s\n", subdir.c_str(), strerror(errno));
+    return false;
+  }
+
+  char tmp_suffix[32];
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp%d", (int)getpid());
+  std::string tmp = file + tmp_suffix;
+  fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "page store: cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = write(fd, page, len) == (ssize_t)len;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp.c_str(), file.c_str()) == 0;
+  if (!ok)
+  {
+    fprintf(stderr, "page store: cannot write %s: %s\n", file.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  written++;
+  return true;
+}
+
+bool page_store_t::get(const page_hash_t& h, char* page, size_t len)
+{
+  std::string file = path(h);
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    fprintf(stderr, "page store: missing page %s\n", file.c_str());
+    return false;
+  }
+  bool ok = read(fd, page, len) == (ssize_t)len;
+  close(fd);
+  if (!ok)
+    fprintf(stderr, "page store: short page %s\n", file.c_str());
+  return ok;
+}
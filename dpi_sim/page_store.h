@@ -0,0 +1,57 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PAGE_STORE_H
+#define _RISCV_PAGE_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// 128-bit content hash of a page.
+struct page_hash_t
+{
+  uint64_t lo;
+  uint64_t hi;
+
+  std::string hex() const;
+};
+
+// Content-addressed store of memory pages shared by many checkpoints.
+//
+// Each page is a file named by the hash of its contents, under a
+// subdirectory named by the first byte of the hash. A checkpoint that
+// uses the store only records which hash each of its pages has, so pages
+// that several checkpoints share (code, read-only data, untouched heap)
+// are written and kept once. Files are written under a temporary name and
+// renamed into place, so several simulators can fill one store at once.
+//
+// The hash is MurmurHash3, which is fast but not collision resistant. So
+// put() compares the contents of a page that is already stored with the
+// page it was asked to add, and fails on a mismatch rather than let two
+// different pages share one file. get() trusts the file it finds.
+class page_store_t
+{
+public:
+  page_store_t(const std::string& _dir) : dir(_dir), written(0) {}
+
+  static page_hash_t hash(const char* page, size_t len);
+
+  // Add 'page' to the store unless it is already there. Returns false if
+  // it cannot be written, or if a different page is stored under 'h'.
+  bool put(const page_hash_t& h, const char* page, size_t len);
+  // Read the page with hash 'h' into 'page'.
+  bool get(const page_hash_t& h, char* page, size_t len);
+
+  const std::string& get_dir() { return dir; }
+  size_t pages_written() { return written; }
+
+private:
+  std::string dir;
+  size_t written;
+  std::vector<char> stored; // buffer for comparing an already stored page
+
+  std::string path(const page_hash_t& h);
+};
+
+#endif
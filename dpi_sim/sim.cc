@@ -5,14 +5,19 @@
 #include "sim.h"
 #include "htif.h"
 #include <map>
+#include <algorithm>
 #include <iostream>
 #include <climits>
 #include <cstdlib>
 #include <cassert>
 #include <signal.h>
+#include <sys/mman.h>
 #include <iostream>
 #include <fstream>
 #include "dpisim.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 volatile bool ctrlc_pressed = false;
 static void handle_signal(int sig)
@@ -26,11 +31,14 @@ static void handle_signal(int sig)
 
 sim_t::sim_t(size_t nprocs, size_t mem_mb, const std::vector<std::string>& args, proc_type_t _proc_type)
 	: htif(new htif_isasim_t(this, args)), procs(std::max(nprocs, size_t(1))),
-	  current_step(0), idle_cycles(0), current_proc(0), debug(false), checkpointing_enabled(false)
+	  htif_idle_ticks(0), current_step(0), idle_cycles(0), current_proc(0), proc_steps(procs.size(), 0),
+	  debug(false), checkpointing_enabled(false), next_checkpoint(0), fast_retired(0),
+	  jit_enabled(false), lazy_restore(false), raw_checkpoint(false)
 {
 	signal(SIGINT, &handle_signal);
 	// allocate target machine's memory, shrinking it as necessary
-	// until the allocation succeeds
+	// until the allocation succeeds. It is mapped rather than calloc'd so
+	// that it is page aligned for a lazy checkpoint restore.
 	size_t memsz0 = (size_t)mem_mb << 20;
 	size_t quantum = 1L << 20;
 	if (memsz0 == 0) {
@@ -38,7 +46,8 @@ sim_t::sim_t(size_t nprocs, size_t mem_mb, const std::vector<std::string>& args,
 	}
 
 	memsz = memsz0;
-	while ((mem = (char*)calloc(1, memsz)) == NULL) {
+	while ((mem = (char*)mmap(NULL, memsz, PROT_READ | PROT_WRITE,
+	                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
 		memsz = memsz*10/11/quantum*quantum;
 	}
 
@@ -92,7 +101,11 @@ sim_t::~sim_t()
 		delete pmmu;
 	}
 	delete debug_mmu;
-	free(mem);
+	if (lazy_mem)
+		fprintf(stderr, "lazy restore: read %zu of %zu checkpoint pages\n",
+		        lazy_mem->pages_filled(), lazy_mem->pages_listed());
+	lazy_mem.reset();
+	munmap(mem, memsz);
 }
 
 void sim_t::send_ipi(reg_t who)
@@ -187,7 +200,8 @@ bool sim_t::step(size_t n)
 			}
 
       // If HTIF is done, this will return false
-			htif_return = htif->tick();
+			if (htif_tick_due())
+				htif_return = htif->tick();
 		}
 	}
 
@@ -198,6 +212,43 @@ bool sim_t::step(size_t n)
   return htif_return;
 }
 
+// Step only core proc_n by one instruction. Used by the per-hart debug
+// buffers so that refilling one hart's buffer does not advance the others.
+// HTIF is ticked every INTERLEAVE steps of that core.
+bool sim_t::step_proc(size_t proc_n)
+{
+  size_t instret = 0;
+  procs[proc_n]->step(1,instret);
+
+  if (++proc_steps[proc_n] < INTERLEAVE)
+    return true;
+
+  proc_steps[proc_n] = 0;
+  procs[proc_n]->yield_load_reservation();
+  // If HTIF is done, this will return false
+  if (!htif_tick_due())
+    return true;
+  return htif->tick();
+}
+
+// HTIF only has work to do while a host transaction is in flight, which
+// starts with the target writing tohost. Tick it then, and otherwise
+// only every HTIF_IDLE_INTERVAL calls so that host-initiated requests
+// are still picked up. The decision depends only on the retired
+// instruction stream, so the ISA sim and DPI sim stay in step.
+bool sim_t::htif_tick_due()
+{
+  if (!htif->quiescent() || !running())
+    return true;
+  for (size_t i = 0; i < procs.size(); i++)
+    if (procs[i]->get_state()->tohost)
+      return true;
+  if (++htif_idle_ticks < HTIF_IDLE_INTERVAL)
+    return false;
+  htif_idle_ticks = 0;
+  return true;
+}
+
 // Currently supports only one core - can be easily extended to all cores
 bool sim_t::run_fast(size_t n)
 {
@@ -205,14 +256,20 @@ bool sim_t::run_fast(size_t n)
   bool old_checker = get_procs_checker();
   //set_procs_debug(true);
   set_procs_checker(false);
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_jit(jit_enabled);
 
   bool htif_return = true;
   size_t total_retired = 0;
   size_t steps = 0;
+  take_due_checkpoints();
   while(total_retired < n && htif_return)
 	{
     size_t instret = 0;
 		steps = std::min(n - total_retired, INTERLEAVE - current_step);
+    // Stop exactly at the next checkpoint of a multi-point run.
+    if (next_checkpoint < checkpoint_points.size())
+      steps = std::min(steps, checkpoint_points[next_checkpoint] - fast_retired);
 
     // This function continues until it has retired "steps" instructions
     // or it encounters a cycle with 0 retired instructions.
@@ -225,8 +282,10 @@ bool sim_t::run_fast(size_t n)
     }
 
     total_retired += instret;
+    fast_retired += instret;
 		//current_step += steps;
 		current_step += instret;
+    take_due_checkpoints();
     // Either the core has retired INTERLEAVE number of instructions
     // or it has been idle for a INTERLEAVE steps, do a HTIF tick and move to 
     // the next core.
@@ -240,7 +299,8 @@ bool sim_t::run_fast(size_t n)
 			}
 
       // If HTIF is done, this will return false
-			htif_return = htif->tick();
+			if (htif_tick_due())
+				htif_return = htif->tick();
 		}
 	}
 
@@ -261,6 +321,8 @@ bool sim_t::run_fast(size_t n)
 
   set_procs_debug(old_debug);
   set_procs_checker(old_checker);
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_jit(false);
   return htif_return;
 }
 
@@ -293,13 +355,83 @@ void sim_t::init_checkpoint(std::string _checkpoint_file)
   htif->start_checkpointing(checkpoint_file+".syscall");
 }
 
+// Checkpoint <base>.<n> is written by run_fast() once n instructions have
+// been fast-forwarded, for each n in 'points', all in the same pass. The
+// HTIF log keeps running across them and each checkpoint gets a copy of
+// it up to its own point.
+void sim_t::init_checkpoint(std::string _checkpoint_file, const std::vector<size_t>& points)
+{
+  init_checkpoint(_checkpoint_file);
+  checkpoint_points = points;
+  std::sort(checkpoint_points.begin(), checkpoint_points.end());
+  checkpoint_points.erase(std::unique(checkpoint_points.begin(), checkpoint_points.end()),
+                          checkpoint_points.end());
+  next_checkpoint = 0;
+  while (next_checkpoint < checkpoint_points.size() && checkpoint_points[next_checkpoint] < fast_retired)
+    next_checkpoint++;
+}
+
 bool sim_t::create_checkpoint()
+{
+  htif->stop_checkpointing();
+  return write_checkpoint(checkpoint_file);
+}
+
+// Write the checkpoints of a multi-point run that are due now.
+bool sim_t::take_due_checkpoints()
+{
+  bool ok = true;
+  while (next_checkpoint < checkpoint_points.size() &&
+         checkpoint_points[next_checkpoint] == fast_retired)
+  {
+    std::string name = checkpoint_file + "." + std::to_string(checkpoint_points[next_checkpoint++]);
+    fprintf(stderr, "Writing checkpoint %s after %zu instructions\n", name.c_str(), fast_retired);
+    if (!htif->save_checkpoint_log(name+".syscall")) {
+      std::cerr << "ERROR: Writing `" << name << ".syscall' failed.\n";
+      ok = false;
+      continue;
+    }
+    ok = write_checkpoint(name) && ok;
+    if (next_checkpoint == checkpoint_points.size())
+      htif->stop_checkpointing();
+  }
+  return ok;
+}
+
+// Write the combined .ckz file of checkpoint 'name', whose HTIF log is
+// already in <name>.syscall. The uncompressed <name>.memory and
+// <name>.proc that a lazy restore reads are only written on request, as
+// they cost a second pass over memory.
+bool sim_t::write_checkpoint(std::string name)
 {
   bool htif_return = true;
 
-  htif->stop_checkpointing();
-  create_memory_checkpoint(checkpoint_file+".memory");
-  create_proc_checkpoint(checkpoint_file+".proc");
+  if (raw_checkpoint) {
+    create_memory_checkpoint(name+".memory");
+    create_proc_checkpoint(name+".proc");
+  }
+
+  // The same checkpoint as one block-compressed stream for
+  // restore_checkpoint(): the HTIF log and its end marker, then memory,
+  // then the processor state.
+  ochkstream_t chkpt;
+  chkpt.open((name+".ckz").c_str());
+  std::ifstream syscall_log((name+".syscall").c_str());
+  if (syscall_log.peek() != EOF)
+    chkpt << syscall_log.rdbuf();
+  chkpt << "END_HTIF_CHECKPOINT 0 0\n";
+  bool pages_ok = write_memory_checkpoint(chkpt);
+  write_proc_checkpoint(chkpt);
+  chkpt.close();
+  if (!chkpt.good() || !pages_ok) {
+    std::cerr << "ERROR: Writing `" << name << ".ckz' failed.\n";
+    htif_return = false;
+  }
+  fprintf(stderr,"Checkpointed State for %s:\n",proc_type == DPI_SIM ? "dpi_sim" : "isa_sim");
+  procs[current_proc]->get_state()->dump(stderr);
+  if (page_store)
+    fprintf(stderr, "Page store %s: %zu new pages written so far\n",
+            page_store->get_dir().c_str(), page_store->pages_written());
 
   return htif_return;
 }
@@ -322,14 +454,26 @@ bool sim_t::restore_checkpoint(std::string restore_file)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
   bool htif_return = true;
 
-  // Check if file name has .gz extension. If not, append .gz to the name
-  if(restore_file.substr(restore_file.find_last_of(".") + 1) != "gz") {
-    restore_file = restore_file+".gz";
+  if (lazy_restore) {
+    size_t dot = restore_file.find_last_of(".");
+    if (dot != std::string::npos && (restore_file.substr(dot) == ".gz" || restore_file.substr(dot) == ".ckz"))
+      restore_file.erase(dot);
+    return restore_checkpoint_lazy(restore_file);
+  }
+
+  // Use the name as given if it has a .ckz or .gz extension. Otherwise
+  // prefer the block-compressed <name>.ckz and fall back to <name>.gz.
+  std::string ext = restore_file.substr(restore_file.find_last_of(".") + 1);
+  if (ext != "ckz" && ext != "gz") {
+    if (chkstreambuf_t::is_chk_file((restore_file+".ckz").c_str()))
+      restore_file = restore_file+".ckz";
+    else
+      restore_file = restore_file+".gz";
   }
 
   //std::cerr << "Trying to restore HTIF checkpoint from " << restore_file << std::endl;
   fflush(0);
-  restore_chkpt.open (restore_file.c_str(), std::ios::in | std::ios::binary);
+  restore_chkpt.open (restore_file.c_str());
   if ( ! restore_chkpt.good()) {
     std::cerr << "ERROR: Opening file `" << restore_file << "' failed.\n";
 	  return false;
@@ -349,11 +493,71 @@ bool sim_t::restore_checkpoint(std::string restore_file)
 
 }
 
-void sim_t::create_memory_checkpoint(std::string memory_file)
+// A lazy restore needs random access to the memory image, so it reads the
+// uncompressed files that a checkpoint written with raw files enabled
+// has (<base>.syscall, <base>.memory and <base>.proc) instead of the
+// combined .ckz or .gz stream. If
+// the memory image cannot be paged in on demand it is read in full.
+bool sim_t::restore_checkpoint_lazy(std::string restore_base)
 {
+  std::ifstream syscall_chkpt((restore_base+".syscall").c_str());
+  std::ifstream proc_chkpt((restore_base+".proc").c_str(), std::ios::in | std::ios::binary);
+  if (!syscall_chkpt.good() || !proc_chkpt.good()) {
+    std::cerr << "ERROR: Opening `" << restore_base << ".syscall' or `" << restore_base << ".proc' failed"
+              << " (a lazy restore needs a checkpoint written with --chkpt-raw).\n";
+    return false;
+  }
+
+  bool htif_return = htif->restore_checkpoint(syscall_chkpt);
+  std::cerr << "Done restoring HTIF checkpoint from " << restore_base << ".syscall" << std::endl;
+
+  lazy_mem.reset(new lazy_mem_t(mem, memsz));
+  if (!lazy_mem->open(restore_base+".memory")) {
+    lazy_mem.reset();
+    std::ifstream memory_chkpt((restore_base+".memory").c_str(), std::ios::in | std::ios::binary);
+    if (!memory_chkpt.good()) {
+      std::cerr << "ERROR: Opening `" << restore_base << ".memory' failed.\n";
+      return false;
+    }
+    restore_memory_checkpoint(memory_chkpt);
+  }
+  restore_proc_checkpoint(proc_chkpt);
+  std::cerr << "Done restoring mem/reg checkpoint from " << restore_base << std::endl;
+
+  return htif_return;
+}
 
+static bool page_is_zero(const char* page)
+{
+#ifdef __SSE2__
+  const __m128i* p = (const __m128i*)page;
+  for (size_t i = 0; i < PGSIZE / sizeof(__m128i); i += 4)
+  {
+    __m128i x = _mm_or_si128(_mm_or_si128(_mm_load_si128(p + i), _mm_load_si128(p + i + 1)),
+                             _mm_or_si128(_mm_load_si128(p + i + 2), _mm_load_si128(p + i + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff)
+      return false;
+  }
+#else
+  const uint64_t* p = (const uint64_t*)page;
+  for (size_t i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+    if (p[i])
+      return false;
+#endif
+  return true;
+}
+
+void sim_t::create_memory_checkpoint(std::string memory_file)
+{
   std::fstream memory_chkpt;
   memory_chkpt.open (memory_file, std::ios::out | std::ios::binary);
+  if (!write_memory_checkpoint(memory_chkpt))
+    std::cerr << "ERROR: Writing pages of `" << memory_file << "' to the page store failed.\n";
+  memory_chkpt.close();
+}
+
+bool sim_t::write_memory_checkpoint(std::ostream& memory_chkpt)
+{
   //uint64_t buf[1024];
   //for (size_t i = 0; i < 0x80000; i++){
   //  for (size_t j = 0; i < 1024; i++){
@@ -361,24 +565,59 @@ void sim_t::create_memory_checkpoint(std::string memory_file)
   //  }
   //  memory_chkpt.write((char *)&buf[0],1024*8);
   //}
-  uint64_t signature = 0xbaadbeefdeadbeef;
+  uint64_t signature = page_store ? MEM_CHKPT_STORE_SIGNATURE : MEM_CHKPT_SPARSE_SIGNATURE;
+  uint64_t chkpt_memsz = memsz;
+  uint64_t page_size = PGSIZE;
+  assert(memsz % PGSIZE == 0);
+  std::vector<uint64_t> pages;
+  for (uint64_t page = 0; page < memsz / PGSIZE; page++)
+    if (!page_is_zero(mem + page*PGSIZE))
+      pages.push_back(page);
+  uint64_t npages = pages.size();
+
   memory_chkpt.write((char*)&signature,8);
-  memory_chkpt.write(mem,memsz);
-  memory_chkpt.close();
+  memory_chkpt.write((char*)&chkpt_memsz,8);
+  memory_chkpt.write((char*)&page_size,8);
+  memory_chkpt.write((char*)&npages,8);
+  memory_chkpt.write((char*)pages.data(),npages*8);
+  if (!page_store) {
+    for (size_t i = 0; i < pages.size(); i++)
+      memory_chkpt.write(mem + pages[i]*PGSIZE,PGSIZE);
+    return true;
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < pages.size(); i++)
+  {
+    page_hash_t h = page_store_t::hash(mem + pages[i]*PGSIZE, PGSIZE);
+    ok = ok && page_store->put(h, mem + pages[i]*PGSIZE, PGSIZE);
+    memory_chkpt.write((char*)&h,sizeof(h));
+  }
+  return ok;
 }
 
 void sim_t::create_proc_checkpoint(std::string proc_file)
 {
   std::fstream proc_chkpt;
   proc_chkpt.open (proc_file, std::ios::out | std::ios::binary);
+  write_proc_checkpoint(proc_chkpt);
+  proc_chkpt.close();
+}
+
+// Processor checkpoints start with a signature and state_t. The ASID is
+// kept by the MMU rather than in state_t, so the current format follows
+// state_t with it. The older format has no ASID and restores with ASID 0.
+static const uint64_t PROC_CHKPT_SIGNATURE = 0xdeadbeefbaadbeef;
+static const uint64_t PROC_CHKPT_ASID_SIGNATURE = 0xdeadbeefbaadbee1;
+
+void sim_t::write_proc_checkpoint(std::ostream& proc_chkpt)
+{
   state_t *state = procs[current_proc]->get_state();
-  uint64_t signature = 0xdeadbeefbaadbeef;
+  uint64_t signature = PROC_CHKPT_ASID_SIGNATURE;
+  uint64_t asid = procs[current_proc]->get_mmu()->get_asid();
   proc_chkpt.write((char*)&signature,8);
   proc_chkpt.write((char *)state,sizeof(state_t));
-  proc_chkpt.close();
-
-  fprintf(stderr,"Checkpointed State for %s:\n",proc_type == DPI_SIM ? "dpi_sim" : "isa_sim");
-  procs[current_proc]->get_state()->dump(stderr);
+  proc_chkpt.write((char*)&asid,8);
 }
 
 //void sim_t::restore_memory_checkpoint(std::string memory_file)
@@ -406,11 +645,63 @@ void sim_t::restore_memory_checkpoint(std::istream& memory_chkpt)
   uint64_t signature;
   uint64_t chkpt_memsz;
   memory_chkpt.read((char*)&signature,8);
-  assert(signature == 0xbaadbeefdeadbeef);
+  assert(signature == MEM_CHKPT_SIGNATURE || signature == MEM_CHKPT_SPARSE_SIGNATURE ||
+         signature == MEM_CHKPT_STORE_SIGNATURE || signature == MEM_CHKPT_INTERLEAVED_SIGNATURE);
   // Check that the checkpointed memory size the current simulator memory size are same
   memory_chkpt.read((char*)&chkpt_memsz,sizeof(chkpt_memsz));
   assert(memsz == chkpt_memsz);
-  memory_chkpt.read(mem,memsz);
+
+  if (signature == MEM_CHKPT_SIGNATURE)
+  {
+    memory_chkpt.read(mem,memsz);
+    return;
+  }
+
+  // The HTIF replay has already written memory, so drop all of it back to
+  // zero pages before writing only the listed ones.
+  madvise(mem, memsz, MADV_DONTNEED);
+  uint64_t page_size, npages;
+  memory_chkpt.read((char*)&page_size,8);
+  assert(page_size != 0 && memsz % page_size == 0);
+
+  if (signature == MEM_CHKPT_INTERLEAVED_SIGNATURE)
+  {
+    uint64_t page;
+    while (memory_chkpt.read((char*)&page,8) && page != MEM_CHKPT_INTERLEAVED_END)
+    {
+      assert(page < memsz / page_size);
+      memory_chkpt.read(mem + page*page_size,page_size);
+    }
+    assert(memory_chkpt.good());
+    return;
+  }
+
+  memory_chkpt.read((char*)&npages,8);
+  assert(npages <= memsz / page_size);
+  std::vector<uint64_t> pages(npages);
+  memory_chkpt.read((char*)pages.data(),npages*8);
+  if (signature == MEM_CHKPT_STORE_SIGNATURE && !page_store) {
+    std::cerr << "ERROR: The checkpoint's pages are in a page store, but no store was given.\n";
+    exit(-1);
+  }
+  for (size_t i = 0; i < pages.size(); i++)
+  {
+    assert(pages[i] < memsz / page_size);
+    if (signature == MEM_CHKPT_SPARSE_SIGNATURE) {
+      memory_chkpt.read(mem + pages[i]*page_size,page_size);
+      continue;
+    }
+    page_hash_t h;
+    memory_chkpt.read((char*)&h,sizeof(h));
+    if (!page_store->get(h, mem + pages[i]*page_size, page_size))
+      exit(-1);
+  }
+  assert(memory_chkpt.good());
+}
+
+void sim_t::set_checkpoint_store(const std::string& dir)
+{
+  page_store.reset(new page_store_t(dir));
 }
 
 //void sim_t::restore_proc_checkpoint(std::string proc_file)
@@ -441,9 +732,16 @@ void sim_t::restore_proc_checkpoint(std::istream& proc_chkpt)
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
   state_t *state = procs[0]->get_state();
   uint64_t signature;
+  uint64_t asid = 0;
   proc_chkpt.read((char*)&signature,8);
-  assert(signature = 0xdeadbeefbaadbeef);
+  assert(signature == PROC_CHKPT_SIGNATURE || signature == PROC_CHKPT_ASID_SIGNATURE);
   proc_chkpt.read((char *)state,sizeof(state_t));
+  if (signature == PROC_CHKPT_ASID_SIGNATURE)
+    proc_chkpt.read((char*)&asid,8);
+  // state_t was overwritten behind the MMU's back, so drop every
+  // translation made under the old page table root as well.
+  procs[0]->get_mmu()->set_asid(asid);
+  procs[0]->get_mmu()->flush_tlb();
 }
 
 void sim_t::stop()
@@ -471,6 +769,42 @@ void sim_t::set_histogram(bool value)
 	}
 }
 
+void sim_t::set_decode_cache(size_t entries, size_t ways)
+{
+	for (size_t i = 0; i < procs.size(); i++) {
+		procs[i]->set_decode_cache(entries, ways);
+	}
+}
+
+void sim_t::set_tlb(size_t entries, size_t ways)
+{
+	for (size_t i = 0; i < procs.size(); i++) {
+		procs[i]->set_tlb(entries, ways);
+	}
+}
+
+void sim_t::set_fusion(bool value)
+{
+	for (size_t i = 0; i < procs.size(); i++) {
+		procs[i]->set_fusion(value);
+	}
+}
+
+void sim_t::set_jit(bool value)
+{
+	jit_enabled = value;
+}
+
+void sim_t::set_lazy_restore(bool value)
+{
+	lazy_restore = value;
+}
+
+void sim_t::set_checkpoint_raw(bool value)
+{
+	raw_checkpoint = value;
+}
+
 void sim_t::set_procs_debug(bool value)
 {
 	for (size_t i=0; i< procs.size(); i++) {
@@ -495,6 +829,11 @@ void sim_t::set_procs_pipe(debug_buffer_t* pipe)
 	}
 }
 
+void sim_t::set_proc_pipe(size_t proc_n, debug_buffer_t* pipe)
+{
+	procs.at(proc_n)->set_pipe(pipe);
+}
+
 void sim_t::set_procs_checker(bool value)
 {
 	for (size_t i=0; i< procs.size(); i++) {
@@ -10,8 +10,11 @@
 #include <memory>
 #include <fstream> //Changes: Mohit (library support for reading checkpoint)
 #include <gzstream.h> //Changes: Mohit (library support for restoring checkpoint)
+#include <chkstream.h>
 //#include "dpisim.h"
 #include "mmu.h"
+#include "lazy_mem.h"
+#include "page_store.h"
 
 #define DEBUG_MMU true
 #define MICRO_MMU true
@@ -32,9 +35,17 @@ public:
 	void boot();
 	int run();
 	bool running();
+	bool htif_tick_due(); // whether HTIF has anything to do at this tick point
 	void stop();
 	void set_debug(bool value);
 	void set_histogram(bool value);
+	void set_jit(bool value); // use translated code in run_fast()
+	void set_fusion(bool value); // fuse common instruction pairs while the checker is off
+	void set_decode_cache(size_t entries, size_t ways);
+	void set_tlb(size_t entries, size_t ways);
+	void set_lazy_restore(bool value); // page memory in from the checkpoint on first touch
+	void set_checkpoint_store(const std::string& dir); // keep checkpoint pages in a shared page store
+	void set_checkpoint_raw(bool value); // also write uncompressed <name>.memory and <name>.proc
 	void set_procs_debug(bool value);
 	void set_procs_checker(bool value);
 	bool get_procs_debug();
@@ -54,7 +65,17 @@ public:
 		return procs.at(i);
 	}
 
+	// host view of target physical memory, shared by all cores
+	char* get_mem_base() {
+		return mem;
+	}
+	size_t get_memsz() {
+		return memsz;
+	}
+
   void init_checkpoint(std::string _checkpoint_file);
+  // Checkpoint at several instruction counts during one run_fast() pass.
+  void init_checkpoint(std::string _checkpoint_file, const std::vector<size_t>& points);
   bool create_checkpoint();
   bool restore_checkpoint(std::string restore_file);
 
@@ -63,6 +84,7 @@ public:
 	reg_t get_scr(int which);
 
   void set_procs_pipe(debug_buffer_t* pipe);
+  void set_proc_pipe(size_t proc_n, debug_buffer_t* pipe);
 
   void step_till_pc(reg_t break_pc,unsigned int proc_n);
 
@@ -75,18 +97,32 @@ private:
 	std::unique_ptr<htif_isasim_t> htif;
 	char* mem; // main memory
 	size_t memsz; // memory size in bytes
+	std::unique_ptr<lazy_mem_t> lazy_mem; // set while memory is restored on demand
+	std::unique_ptr<page_store_t> page_store; // shared page store for checkpoints, if any
 	mmu_t* debug_mmu;  // debug port into main memory
 	std::vector<processor_t*> procs;
 
 	bool step(size_t n); // step through simulation
+	bool step_proc(size_t proc_n); // step a single core by one instruction
 	static const size_t INTERLEAVE = 50;
+	// While HTIF is quiescent, poll it only every HTIF_IDLE_INTERVAL
+	// INTERLEAVE boundaries.
+	static const size_t HTIF_IDLE_INTERVAL = 64;
+	size_t htif_idle_ticks;
 	size_t current_step;
 	size_t idle_cycles;
 	size_t current_proc;
+	std::vector<size_t> proc_steps; // per-core step count since the last HTIF tick (step_proc)
 	bool debug;
 	bool histogram_enabled; // provide a histogram of PCs
   bool checkpointing_enabled;
   std::string checkpoint_file;
+  std::vector<size_t> checkpoint_points; // ascending, for a multi-point run
+  size_t next_checkpoint; // index of the next point not yet written
+  size_t fast_retired;    // instructions retired by run_fast() so far
+  bool jit_enabled;
+  bool lazy_restore;
+  bool raw_checkpoint;
 
 	// presents a prompt for introspection into the simulation
 	void interactive();
@@ -109,14 +145,19 @@ private:
 	reg_t get_tohost(const std::vector<std::string>& args);
 
   ogzstream proc_chkpt; //Changes: Mohit (Checkpoint var)
-  igzstream restore_chkpt; //Changes: Mohit (Checkpoint var)
+  ichkstream_t restore_chkpt; // block-compressed or legacy .gz checkpoint
   void create_memory_checkpoint(std::string memory_file);
   //void restore_memory_checkpoint(std::string memory_file);
   void create_proc_checkpoint(std::string proc_file);
+  bool write_memory_checkpoint(std::ostream& memory_chkpt);
+  void write_proc_checkpoint(std::ostream& proc_chkpt);
   //void restore_proc_checkpoint(std::string proc_file);
   
   void restore_memory_checkpoint(std::istream& memory_chkpt); //Changes: Mohit (Modified function for restoring memory checkpoint)
   void restore_proc_checkpoint(std::istream& proc_chkpt); //Changes: Mohit (Modified function for restoring processor checkpoint)
+  bool restore_checkpoint_lazy(std::string restore_base);
+  bool write_checkpoint(std::string name);
+  bool take_due_checkpoints();
 
   void flush_caches();
 
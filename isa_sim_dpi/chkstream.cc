@@ -0,0 +1,420 @@
+// See LICENSE for license details.
+
+#include "chkstream.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+static const char CHK_MAGIC[8] = {'R', 'V', 'C', 'K', 'Z', '0', '0', '1'};
+static const char CHK_INDEX_MAGIC[8] = {'R', 'V', 'C', 'K', 'Z', 'I', 'D', 'X'};
+static const size_t CHK_HEADER_SIZE = 16;
+static const size_t CHK_TRAILER_SIZE = 24;
+static const size_t CHK_MAX_BLOCK_SIZE = 64 << 20;
+static const unsigned CHK_MAX_THREADS = 32;
+
+static bool pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+  for (size_t done = 0; done < len; )
+  {
+    ssize_t n = pread(fd, (char*)buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+chk_pool_t::chk_pool_t(unsigned threads)
+  : stopping(false)
+{
+  for (unsigned i = 0; i < threads; i++)
+    workers.push_back(std::thread(&chk_pool_t::worker_loop, this));
+}
+
+chk_pool_t::~chk_pool_t()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+void chk_pool_t::submit(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobs.push_back(job);
+  }
+  wake.notify_one();
+}
+
+void chk_pool_t::worker_loop()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]{ return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        return;
+      job = jobs.front();
+      jobs.pop_front();
+    }
+    job();
+  }
+}
+
+chkstreambuf_t::chkstreambuf_t()
+  : block_size(0), fd(-1), writing(false), failed(false), pool(NULL),
+    current(-1), file_offset(0), next_block(0)
+{
+  setg(NULL, NULL, NULL);
+  setp(NULL, NULL);
+}
+
+bool chkstreambuf_t::is_chk_file(const char* name)
+{
+  char magic[sizeof(CHK_MAGIC)];
+  int f = ::open(name, O_RDONLY | O_CLOEXEC);
+  if (f < 0)
+    return false;
+  bool ok = pread_all(f, magic, sizeof(magic), 0) && !memcmp(magic, CHK_MAGIC, sizeof(magic));
+  ::close(f);
+  return ok;
+}
+
+chkstreambuf_t* chkstreambuf_t::open(const char* name, std::ios::openmode mode, unsigned threads)
+{
+  if (is_open())
+    return NULL;
+  writing = (mode & std::ios::out) != 0;
+  failed = false;
+
+  if (writing)
+  {
+    fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return NULL;
+    uint64_t bs = CHK_BLOCK_SIZE;
+    block_size = CHK_BLOCK_SIZE;
+    if (!write_all(CHK_MAGIC, sizeof(CHK_MAGIC)) || !write_all(&bs, sizeof(bs)))
+    {
+      ::close(fd);
+      fd = -1;
+      return NULL;
+    }
+    file_offset = CHK_HEADER_SIZE;
+    setup(threads);
+    current = 0;
+    setp(&blocks[0].raw[0], &blocks[0].raw[0] + block_size);
+    return this;
+  }
+
+  fd = ::open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (!read_index())
+  {
+    ::close(fd);
+    fd = -1;
+    index.clear();
+    return NULL;
+  }
+  setup(threads);
+  next_block = 0;
+  current = -1;
+  for (size_t b = 0; b < blocks.size() && next_block < index.size(); b++)
+    submit_inflate(b);
+  return this;
+}
+
+void chkstreambuf_t::setup(unsigned threads)
+{
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  threads = std::max(1u, std::min(threads, CHK_MAX_THREADS));
+  pool = new chk_pool_t(threads);
+
+  // A couple of spare buffers keep every thread busy while the stream
+  // is filling or draining the oldest one.
+  blocks.resize(threads + 2);
+  for (size_t b = 0; b < blocks.size(); b++)
+  {
+    blocks[b].raw.resize(block_size);
+    blocks[b].packed.resize(compressBound(block_size));
+    blocks[b].done = true;
+    blocks[b].ok = true;
+  }
+}
+
+bool chkstreambuf_t::read_index()
+{
+  struct stat st;
+  char header[CHK_HEADER_SIZE];
+  uint64_t trailer[CHK_TRAILER_SIZE / 8];
+  if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < CHK_HEADER_SIZE + CHK_TRAILER_SIZE)
+    return false;
+  if (!pread_all(fd, header, sizeof(header), 0) || memcmp(header, CHK_MAGIC, sizeof(CHK_MAGIC)))
+    return false;
+  if (!pread_all(fd, trailer, sizeof(trailer), st.st_size - CHK_TRAILER_SIZE) ||
+      memcmp(&trailer[2], CHK_INDEX_MAGIC, sizeof(CHK_INDEX_MAGIC)))
+    return false;
+
+  uint64_t bs;
+  memcpy(&bs, header + sizeof(CHK_MAGIC), sizeof(bs));
+  uint64_t index_offset = trailer[0], nblocks = trailer[1];
+  if (bs == 0 || bs > CHK_MAX_BLOCK_SIZE || index_offset < CHK_HEADER_SIZE ||
+      nblocks > (st.st_size - CHK_TRAILER_SIZE - index_offset) / sizeof(index_entry_t) ||
+      index_offset + nblocks * sizeof(index_entry_t) != st.st_size - CHK_TRAILER_SIZE)
+    return false;
+  block_size = bs;
+
+  index.resize(nblocks);
+  if (!pread_all(fd, index.data(), nblocks * sizeof(index_entry_t), index_offset))
+    return false;
+  for (size_t i = 0; i < index.size(); i++)
+    if (index[i].raw_len > block_size || index[i].packed_len > compressBound(block_size) ||
+        index[i].offset + index[i].packed_len > index_offset)
+      return false;
+  return true;
+}
+
+void chkstreambuf_t::submit_deflate(size_t b)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    blocks[b].done = false;
+  }
+  pending.push_back(b);
+  pool->submit([this, b]{
+    block_t& k = blocks[b];
+    uLongf len = k.packed.size();
+    bool ok = compress2((Bytef*)&k.packed[0], &len, (const Bytef*)&k.raw[0], k.raw_len,
+                        Z_DEFAULT_COMPRESSION) == Z_OK;
+    k.packed_len = len;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      k.ok = ok;
+      k.done = true;
+    }
+    finished.notify_all();
+  });
+}
+
+void chkstreambuf_t::submit_inflate(size_t b)
+{
+  index_entry_t e = index[next_block++];
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    blocks[b].done = false;
+  }
+  pending.push_back(b);
+  pool->submit([this, b, e]{
+    block_t& k = blocks[b];
+    uLongf len = block_size;
+    bool ok = pread_all(fd, &k.packed[0], e.packed_len, e.offset) &&
+              uncompress((Bytef*)&k.raw[0], &len, (const Bytef*)&k.packed[0], e.packed_len) == Z_OK &&
+              len == e.raw_len;
+    k.raw_len = len;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      k.ok = ok;
+      k.done = true;
+    }
+    finished.notify_all();
+  });
+}
+
+void chkstreambuf_t::wait(size_t b)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  finished.wait(guard, [this, b]{ return blocks[b].done; });
+}
+
+bool chkstreambuf_t::write_all(const void* data, size_t len)
+{
+  for (size_t done = 0; done < len; )
+  {
+    ssize_t n = write(fd, (const char*)data + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+bool chkstreambuf_t::write_block(size_t b)
+{
+  wait(b);
+  block_t& k = blocks[b];
+  if (!k.ok || !write_all(&k.packed[0], k.packed_len))
+    return false;
+  index_entry_t e;
+  e.offset = file_offset;
+  e.packed_len = k.packed_len;
+  e.raw_len = k.raw_len;
+  index.push_back(e);
+  file_offset += k.packed_len;
+  return true;
+}
+
+int chkstreambuf_t::overflow(int c)
+{
+  if (!writing || !is_open() || failed)
+    return EOF;
+
+  blocks[current].raw_len = pptr() - pbase();
+  submit_deflate(current);
+
+  // Buffers are used round robin, so once they are all in flight the
+  // next one is the oldest and has to be written out first.
+  size_t next = (current + 1) % blocks.size();
+  if (pending.size() == blocks.size())
+  {
+    pending.pop_front();
+    if (!write_block(next))
+    {
+      failed = true;
+      return EOF;
+    }
+  }
+  current = next;
+  setp(&blocks[current].raw[0], &blocks[current].raw[0] + block_size);
+
+  if (c != EOF)
+  {
+    *pptr() = c;
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+int chkstreambuf_t::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  if (writing || !is_open() || failed)
+    return EOF;
+
+  // The block just consumed is free to inflate a later one.
+  if (current != (size_t)-1)
+  {
+    if (next_block < index.size())
+      submit_inflate(current);
+    current = -1;
+  }
+  if (pending.empty())
+    return EOF;
+
+  size_t b = pending.front();
+  pending.pop_front();
+  wait(b);
+  if (!blocks[b].ok)
+  {
+    failed = true;
+    return EOF;
+  }
+  current = b;
+  setg(&blocks[b].raw[0], &blocks[b].raw[0], &blocks[b].raw[0] + blocks[b].raw_len);
+  return blocks[b].raw_len ? traits_type::to_int_type(*gptr()) : underflow();
+}
+
+// Blocks are only cut when they are full or the stream is closed, so
+// there is nothing to push out early.
+int chkstreambuf_t::sync()
+{
+  return failed ? -1 : 0;
+}
+
+chkstreambuf_t* chkstreambuf_t::close()
+{
+  if (!is_open())
+    return NULL;
+
+  bool ok = !failed;
+  if (writing)
+  {
+    if (ok && pptr() > pbase())
+    {
+      blocks[current].raw_len = pptr() - pbase();
+      submit_deflate(current);
+    }
+    while (!pending.empty())
+    {
+      size_t b = pending.front();
+      pending.pop_front();
+      ok = write_block(b) && ok;
+    }
+    uint64_t trailer[2] = {file_offset, index.size()};
+    ok = ok && write_all(index.data(), index.size() * sizeof(index_entry_t)) &&
+         write_all(trailer, sizeof(trailer)) &&
+         write_all(CHK_INDEX_MAGIC, sizeof(CHK_INDEX_MAGIC));
+  }
+  else
+  {
+    // Let blocks still being inflated finish before their file goes away.
+    for (size_t i = 0; i < pending.size(); i++)
+      wait(pending[i]);
+  }
+
+  delete pool;
+  pool = NULL;
+  ok = ::close(fd) == 0 && ok;
+  fd = -1;
+  blocks.clear();
+  pending.clear();
+  index.clear();
+  current = -1;
+  setg(NULL, NULL, NULL);
+  setp(NULL, NULL);
+  return ok ? this : NULL;
+}
+
+void ichkstream_t::open(const char* name)
+{
+  bool ok;
+  if (chkstreambuf_t::is_chk_file(name))
+  {
+    ok = chk.open(name, std::ios::in) != NULL;
+    rdbuf(&chk);
+  }
+  else
+  {
+    ok = gz.open(name, std::ios::in) != NULL;
+    rdbuf(&gz);
+  }
+  if (!ok)
+    setstate(std::ios::failbit);
+}
+
+void ichkstream_t::close()
+{
+  if (chk.is_open())
+    chk.close();
+  if (gz.is_open())
+    gz.close();
+}
+
+void ochkstream_t::open(const char* name, unsigned threads)
+{
+  if (!chk.open(name, std::ios::out, threads))
+    setstate(std::ios::failbit);
+}
+
+void ochkstream_t::close()
+{
+  if (!chk.close())
+    setstate(std::ios::failbit);
+}
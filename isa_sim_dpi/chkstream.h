@@ -0,0 +1,134 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_CHKSTREAM_H
+#define _RISCV_CHKSTREAM_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gzstream.h"
+
+// Block-compressed checkpoint container (.ckz).
+//
+// The stream is cut into CHK_BLOCK_SIZE blocks that are deflated
+// independently, so a pool of threads can compress or inflate several of
+// them at once while the stream is produced or consumed in order. An index
+// of block offsets and sizes at the end of the file lets a reader start
+// inflating blocks before it needs them.
+//
+//   header:  CHK_MAGIC, block size
+//   blocks:  zlib streams, back to back
+//   index:   per block, file offset (8 bytes), packed and raw size (4 each)
+//   trailer: index offset, block count, CHK_INDEX_MAGIC
+
+class chk_pool_t
+{
+public:
+  chk_pool_t(unsigned threads);
+  ~chk_pool_t();
+  void submit(std::function<void()> job);
+
+private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stopping;
+
+  void worker_loop();
+};
+
+class chkstreambuf_t : public std::streambuf
+{
+public:
+  static const size_t CHK_BLOCK_SIZE = 1 << 20;
+
+  chkstreambuf_t();
+  ~chkstreambuf_t() { close(); }
+
+  // 'threads' of 0 uses one per host CPU.
+  chkstreambuf_t* open(const char* name, std::ios::openmode mode, unsigned threads = 0);
+  chkstreambuf_t* close();
+  bool is_open() { return fd >= 0; }
+
+  // Whether 'name' starts like a block-compressed checkpoint.
+  static bool is_chk_file(const char* name);
+
+protected:
+  virtual int overflow(int c = EOF);
+  virtual int underflow();
+  virtual int sync();
+
+private:
+  struct block_t
+  {
+    std::vector<char> raw;
+    std::vector<char> packed;
+    size_t raw_len;
+    size_t packed_len;
+    uint64_t offset; // in the file, for a reader
+    bool done;
+    bool ok;
+  };
+
+  struct index_entry_t
+  {
+    uint64_t offset;
+    uint32_t packed_len;
+    uint32_t raw_len;
+  };
+
+  size_t block_size;
+  int fd;
+  bool writing;
+  bool failed;
+  chk_pool_t* pool;
+  std::vector<block_t> blocks;  // ring of buffers in flight
+  std::deque<size_t> pending;   // blocks submitted, oldest first
+  size_t current;               // block behind the get or put area, or -1
+  std::mutex lock;              // guards block_t::done and ok
+  std::condition_variable finished;
+
+  std::vector<index_entry_t> index;
+  uint64_t file_offset;         // writer: end of the file so far
+  size_t next_block;            // reader: next block to submit
+
+  void setup(unsigned threads);
+  bool read_index();
+  void submit_deflate(size_t b);
+  void submit_inflate(size_t b);
+  void wait(size_t b);
+  bool write_block(size_t b);
+  bool write_all(const void* data, size_t len);
+};
+
+// Reads a block-compressed checkpoint, or a legacy gzip checkpoint.
+class ichkstream_t : public std::istream
+{
+public:
+  ichkstream_t() : std::istream(&chk) {}
+  void open(const char* name);
+  void close();
+
+private:
+  chkstreambuf_t chk;
+  gzstreambuf gz;
+};
+
+class ochkstream_t : public std::ostream
+{
+public:
+  ochkstream_t() : std::ostream(&chk) {}
+  void open(const char* name, unsigned threads = 0);
+  void close();
+
+private:
+  chkstreambuf_t chk;
+};
+
+#endif
@@ -130,12 +130,52 @@ private:
   T data[N];
 };
 
+// An instruction as handed to its handler. The register indices and the
+// immediate are extracted once, when the instruction is filled into the
+// icache, instead of on every execution. The immediate is the one of the
+// instruction's own format, so each immediate accessor is only valid for
+// instructions of that format; handlers only use their own. The next-PC
+// delta needs no field, as it is a constant in each handler already.
+class decoded_insn_t : public insn_t
+{
+public:
+  decoded_insn_t() = default;
+  decoded_insn_t(insn_t insn) : insn_t(insn)
+  {
+    switch (insn.opcode())
+    {
+      case 0x23: case 0x27: imm = insn.s_imm(); break;  // STORE, STORE-FP
+      case 0x63: imm = insn.sb_imm(); break;            // BRANCH
+      case 0x37: case 0x17: imm = insn.u_imm(); break;  // LUI, AUIPC
+      case 0x6f: imm = insn.uj_imm(); break;            // JAL
+      default: imm = insn.i_imm(); break;
+    }
+    rd_ = insn.rd();
+    rs1_ = insn.rs1();
+    rs2_ = insn.rs2();
+  }
+  uint64_t rd() { return rd_; }
+  uint64_t rs1() { return rs1_; }
+  uint64_t rs2() { return rs2_; }
+  int64_t i_imm() { return imm; }
+  int64_t s_imm() { return imm; }
+  int64_t sb_imm() { return imm; }
+  int64_t u_imm() { return imm; }
+  int64_t uj_imm() { return imm; }
+
+private:
+  int32_t imm;
+  uint8_t rd_;
+  uint8_t rs1_;
+  uint8_t rs2_;
+};
+
 class processor_t;
-typedef reg_t (*insn_func_t)(processor_t*, insn_t, reg_t);
+typedef reg_t (*insn_func_t)(processor_t*, decoded_insn_t, reg_t);
 struct insn_fetch_t
 {
   insn_func_t func;
-  insn_t insn;
+  decoded_insn_t insn;
 };
 
 
@@ -159,15 +199,21 @@ struct insn_fetch_t
       })
 #endif
 
+// With the checker compiled in, handlers are instantiated with CHECKER
+// true and false (see insn_template.cc). The CHECKER=false versions are
+// used while the checker is off and compile down to plain register file
+// and memory accesses.
 #ifdef RISCV_MICRO_CHECKER
+  #undef MMU
+  #define MMU mmu_port_t<CHECKER>(p->get_mmu())
   #undef RS1
-  #define RS1 p->get_rs(insn.rs1(), pc, RSRC1_OPERAND)
+  #define RS1 (CHECKER ? p->get_rs(insn.rs1(), pc, RSRC1_OPERAND) : STATE.XPR[insn.rs1()])
   #undef RS2
-  #define RS2 p->get_rs(insn.rs2(), pc, RSRC2_OPERAND)
+  #define RS2 (CHECKER ? p->get_rs(insn.rs2(), pc, RSRC2_OPERAND) : STATE.XPR[insn.rs2()])
   #undef WRITE_RD 
   #define WRITE_RD(value) ({ \
         reg_t wdata = value; /* value is a func with side-effects */ \
-        if((insn.rd() != 0) && p->get_checker()){ /* Don't push if destination is ZERO register */  \
+        if(CHECKER && (insn.rd() != 0) && p->get_checker()){ /* Don't push if destination is ZERO register */  \
           PIPE.push_operand_actual(insn.rd(),RDST_OPERAND, wdata, pc); \
         } \
         STATE.XPR.write(insn.rd(), wdata); \
@@ -190,16 +236,16 @@ struct insn_fetch_t
  
 #ifdef RISCV_MICRO_CHECKER
   #undef FRS1
-  #define FRS1 p->get_frs(insn.rs1(), pc, RSRC1_OPERAND)
+  #define FRS1 (CHECKER ? p->get_frs(insn.rs1(), pc, RSRC1_OPERAND) : STATE.FPR[insn.rs1()])
   #undef FRS2
-  #define FRS2 p->get_frs(insn.rs2(), pc, RSRC2_OPERAND)
+  #define FRS2 (CHECKER ? p->get_frs(insn.rs2(), pc, RSRC2_OPERAND) : STATE.FPR[insn.rs2()])
   #undef FRS3
-  #define FRS3 p->get_frs(insn.rs3(), pc, RSRC3_OPERAND)
+  #define FRS3 (CHECKER ? p->get_frs(insn.rs3(), pc, RSRC3_OPERAND) : STATE.FPR[insn.rs3()])
   #undef WRITE_FRD 
   #define WRITE_FRD(value) ({ \
         reg_t wdata = value; /* value is a func with side-effects */ \
         /* Push for all destination registers, even F0 */ \
-        if(p->get_checker()){ /* Don't push if destination is ZERO register */  \
+        if(CHECKER && p->get_checker()){ /* Don't push if destination is ZERO register */  \
           PIPE.push_operand_actual((insn.rd() + NXPR),RDST_OPERAND, wdata, pc); \
         } \
         STATE.FPR.write(insn.rd(), wdata); \
@@ -0,0 +1,86 @@
+// See LICENSE for license details.
+
+#include "fusion.h"
+
+// Fused pairs are only formed from the handlers used with the checker
+// off, so the fused handlers never push to the debug buffer either.
+static const bool CHECKER = false;
+
+#define FUSED_HANDLERS(F) \
+  F(lui) F(auipc) F(addi) F(addiw) F(jalr) F(ld) F(slli) F(srli)
+
+#define DECLARE_HANDLER(name) extern reg_t rv64_##name##_fast(processor_t*, decoded_insn_t, reg_t);
+FUSED_HANDLERS(DECLARE_HANDLER)
+#undef DECLARE_HANDLER
+
+// lui rd, hi; addi rd, rd, lo
+static reg_t fused_lui_addi(processor_t* p, const insn_fetch_t* pair, reg_t pc)
+{
+  decoded_insn_t a = pair[0].insn, b = pair[1].insn;
+  STATE.XPR.write(b.rd(), a.u_imm() + b.i_imm());
+  return pc + 8;
+}
+
+// lui rd, hi; addiw rd, rd, lo
+static reg_t fused_lui_addiw(processor_t* p, const insn_fetch_t* pair, reg_t pc)
+{
+  decoded_insn_t a = pair[0].insn, b = pair[1].insn;
+  STATE.XPR.write(b.rd(), sext32(a.u_imm() + b.i_imm()));
+  return pc + 8;
+}
+
+// auipc rs, hi; jalr rd, lo(rs)
+static reg_t fused_auipc_jalr(processor_t* p, const insn_fetch_t* pair, reg_t pc)
+{
+  decoded_insn_t a = pair[0].insn, b = pair[1].insn;
+  reg_t base = pc + a.u_imm();
+  STATE.XPR.write(a.rd(), base);
+  STATE.XPR.write(b.rd(), pc + 8);
+  return (base + b.i_imm()) & ~reg_t(1);
+}
+
+// auipc rs, hi; ld rd, lo(rs)
+static reg_t fused_auipc_ld(processor_t* p, const insn_fetch_t* pair, reg_t pc)
+{
+  decoded_insn_t a = pair[0].insn, b = pair[1].insn;
+  reg_t base = pc + a.u_imm();
+  STATE.XPR.write(a.rd(), base);
+  STATE.XPR.write(b.rd(), MMU.load_int64(base + b.i_imm()));
+  return pc + 8;
+}
+
+// slli rd, rs, n; srli rd, rd, n
+static reg_t fused_slli_srli(processor_t* p, const insn_fetch_t* pair, reg_t pc)
+{
+  decoded_insn_t a = pair[0].insn, b = pair[1].insn;
+  unsigned shamt = a.i_imm() & 0x3f;
+  STATE.XPR.write(b.rd(), (STATE.XPR[a.rs1()] << shamt) >> shamt);
+  return pc + 8;
+}
+
+fused_func_t fuse_insns(const insn_fetch_t& a, const insn_fetch_t& b)
+{
+  decoded_insn_t x = a.insn, y = b.insn;
+  if (x.rd() == 0 || y.rs1() != x.rd())
+    return NULL;
+
+  if (a.func == rv64_lui_fast && y.rd() == x.rd())
+  {
+    if (b.func == rv64_addi_fast)
+      return fused_lui_addi;
+    if (b.func == rv64_addiw_fast)
+      return fused_lui_addiw;
+  }
+  if (a.func == rv64_auipc_fast)
+  {
+    if (b.func == rv64_jalr_fast)
+      return fused_auipc_jalr;
+    if (b.func == rv64_ld_fast)
+      return fused_auipc_ld;
+  }
+  if (a.func == rv64_slli_fast && b.func == rv64_srli_fast && y.rd() == x.rd() &&
+      (x.i_imm() & 0x3f) == (y.i_imm() & 0x3f))
+    return fused_slli_srli;
+
+  return NULL;
+}
@@ -0,0 +1,18 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_FUSION_H
+#define _RISCV_FUSION_H
+
+#include "mmu.h"
+
+// Superinstructions for common RV64 instruction pairs: lui+addi(w),
+// auipc+jalr, auipc+ld and the slli+srli zero-extension idiom. Pairs are
+// fused when a basic block is built (mmu_t::access_bb) and run by
+// processor_t::step in the fast-forward path. Both instructions still
+// retire; only the second of a pair can trap.
+
+// Return the fused handler for 'a' followed by 'b', or NULL if the pair
+// is not one that is fused.
+fused_func_t fuse_insns(const insn_fetch_t& a, const insn_fetch_t& b);
+
+#endif
@@ -0,0 +1,114 @@
+// See LICENSE for license details.
+
+// Build-time generator for decode_tree.h.
+//
+// Reads the DECLARE_INSN list in encoding.h and prints decode_tree(), a
+// decoder made of nested switches. At each level it switches on the
+// lowest run of bits that every remaining instruction has in its mask
+// (the major opcode first, then funct3, funct7 and so on) until only one
+// candidate is left, which is then checked against its full mask/match.
+// decode_tree() returns the instruction's position in encoding.h, or the
+// number of instructions if it matches none of them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include "encoding.h"
+
+struct insn_info_t
+{
+  const char* name;
+  uint32_t match;
+  uint32_t mask;
+  size_t index;
+};
+
+static std::vector<insn_info_t> insns;
+
+static int popcount(uint32_t x)
+{
+  int n = 0;
+  for (; x; x &= x - 1)
+    n++;
+  return n;
+}
+
+static void indent(int depth)
+{
+  printf("%*s", 2*depth, "");
+}
+
+static void emit(std::vector<insn_info_t> set, uint32_t tested, int depth)
+{
+  uint32_t common = -1;
+  for (auto& i : set)
+    common &= i.mask;
+  common &= ~tested;
+
+  if (set.size() <= 1 || common == 0)
+  {
+    // Overlapping encodings, if any, are resolved most-specific first.
+    std::stable_sort(set.begin(), set.end(),
+      [](const insn_info_t& a, const insn_info_t& b) {
+        return popcount(a.mask) > popcount(b.mask);
+      });
+    for (auto& i : set)
+    {
+      indent(depth);
+      printf("if ((b & 0x%08x) == 0x%08x) return %zu; // %s\n",
+             i.mask, i.match, i.index, i.name);
+    }
+    indent(depth);
+    printf("return %zu;\n", insns.size());
+    return;
+  }
+
+  int lo = __builtin_ctz(common);
+  int len = 0;
+  while (lo + len < 32 && (common >> (lo + len) & 1))
+    len++;
+  uint32_t field = (len == 32 ? -1 : (1u << len) - 1) << lo;
+
+  std::vector<uint32_t> values;
+  for (auto& i : set)
+    values.push_back(i.match & field);
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+
+  indent(depth);
+  printf("switch (b & 0x%08x)\n", field);
+  indent(depth);
+  printf("{\n");
+  for (uint32_t v : values)
+  {
+    std::vector<insn_info_t> sub;
+    for (auto& i : set)
+      if ((i.match & field) == v)
+        sub.push_back(i);
+    indent(depth + 1);
+    printf("case 0x%08x:\n", v);
+    emit(sub, tested | field, depth + 2);
+  }
+  indent(depth + 1);
+  printf("default:\n");
+  indent(depth + 2);
+  printf("return %zu;\n", insns.size());
+  indent(depth);
+  printf("}\n");
+}
+
+int main()
+{
+  #define DECLARE_INSN(name, match, mask) \
+    insns.push_back((insn_info_t){#name, match, mask, insns.size()});
+  #include "encoding.h"
+  #undef DECLARE_INSN
+
+  printf("// Generated by gen_decode from encoding.h. Do not edit.\n\n");
+  printf("static const size_t DECODE_TREE_INSNS = %zu;\n\n", insns.size());
+  printf("static inline size_t decode_tree(uint32_t b)\n{\n");
+  emit(insns, 0, 1);
+  printf("}\n");
+  return 0;
+}
@@ -16,7 +16,7 @@
 #include <fstream>
 
 htif_isasim_t::htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args)
-  : htif_pthread_t(args), sim(_sim), reset(true), seqno(1)
+  : htif_pthread_t(args), sim(_sim), reset(true), seqno(1), idle_polls(0)
 {
     checkpointing_active = false;
 }
@@ -59,6 +59,7 @@ void htif_isasim_t::tick_once()
   memcpy(buf, &hdr, sizeof(hdr));
   recv(buf + sizeof(hdr), hdr.get_payload_size());
   packet_t p(buf);
+  bool idle_poll = false;
 
   assert(hdr.seqno == seqno);
 
@@ -180,6 +181,10 @@ void htif_isasim_t::tick_once()
           abort();
       }
 
+      // A read or swap of an empty tohost is the host polling with nothing to do
+      if (regno == (CSR_TOHOST & 0x1f) && old_val == 0 && (!write || new_val == 0))
+        idle_poll = true;
+
       // Print TOHOST content only when something significant happens)
       if((regno != (CSR_TOHOST & 0x1f)) || ((old_val != 0) || (old_val != new_val))){
         if(checkpointing_active){
@@ -192,6 +197,7 @@ void htif_isasim_t::tick_once()
     default:
       abort();
   }
+  idle_polls = idle_poll ? idle_polls + 1 : 0;
   seqno++;
 }
 
@@ -324,7 +330,11 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
   
   while(restore.good())
   {
-    restore >> token1 >> token2 >> token3;
+    // A log read straight from start_checkpointing() has no end marker.
+    if (!(restore >> token1 >> token2 >> token3)) {
+      token1 = "END_HTIF_CHECKPOINT";
+      token2 = token3 = 0;
+    }
     fprintf(restore_log,"Reading line: %s %ld %ld\n",token1.c_str(),token2,token3);
     if(!token1.compare("READ_MEM"))
     {
@@ -382,6 +392,19 @@ void htif_isasim_t::start_checkpointing(std::string checkpoint_file)
 {
   checkpointing_active = true;
   this->checkpoint     = fopen(checkpoint_file.c_str(), "w")  ;
+  this->checkpoint_name = checkpoint_file;
+}
+
+bool htif_isasim_t::save_checkpoint_log(std::string file)
+{
+  if (!checkpointing_active)
+    return false;
+  fflush(this->checkpoint);
+  std::ifstream log(checkpoint_name.c_str());
+  std::ofstream copy(file.c_str());
+  if (log.peek() != EOF)
+    copy << log.rdbuf();
+  return copy.good();
 }
 
 void htif_isasim_t::stop_checkpointing()
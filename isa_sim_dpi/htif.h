@@ -44,19 +44,27 @@ public:
   ~htif_isasim_t();
   bool tick();
   bool done();
+  // True once the host has gone through two polls of tohost in a row with
+  // nothing to do, i.e. no transaction is in flight.
+  bool quiescent() { return idle_polls >= 2; }
   //bool restore_checkpoint(std::string restore_file);
   bool restore_checkpoint(std::istream& restore); //Changes: Mohit (Modified HTIF checkpoint restore to read from '.gz' file format)
   void start_checkpointing(std::string checkpoint_file);
   void stop_checkpointing();
+  // Copy the log so far to 'file' and keep logging, for a checkpoint
+  // taken partway through the run.
+  bool save_checkpoint_log(std::string file);
 
 private:
   sim_t* sim;
   bool reset;
   uint8_t seqno;
+  unsigned int idle_polls; // consecutive packets that were idle tohost polls
   void setup_replay_state(replay_pkt_t*);
   bool checkpointing_active;
 
   FILE* checkpoint;
+  std::string checkpoint_name;
 
   void tick_once();
 };
@@ -2,18 +2,33 @@
 
 #include "insn_template.h"
 
-reg_t rv32_NAME(processor_t* p, insn_t insn, reg_t pc)
+// Instantiated with the checker (rv32/rv64) and without it (rv32/rv64
+// _fast). processor_t::decode_insn() picks the set matching the current
+// checker mode.
+template <int xlen, bool CHECKER>
+static inline reg_t execute_NAME(processor_t* p, decoded_insn_t insn, reg_t pc)
 {
-  int xlen = 32;
   reg_t npc = sext_xlen(pc + insn_length(OPCODE));
   #include "insns/NAME.h"
   return npc;
 }
 
-reg_t rv64_NAME(processor_t* p, insn_t insn, reg_t pc)
+reg_t rv32_NAME(processor_t* p, decoded_insn_t insn, reg_t pc)
 {
-  int xlen = 64;
-  reg_t npc = sext_xlen(pc + insn_length(OPCODE));
-  #include "insns/NAME.h"
-  return npc;
+  return execute_NAME<32, true>(p, insn, pc);
+}
+
+reg_t rv64_NAME(processor_t* p, decoded_insn_t insn, reg_t pc)
+{
+  return execute_NAME<64, true>(p, insn, pc);
+}
+
+reg_t rv32_NAME_fast(processor_t* p, decoded_insn_t insn, reg_t pc)
+{
+  return execute_NAME<32, false>(p, insn, pc);
+}
+
+reg_t rv64_NAME_fast(processor_t* p, decoded_insn_t insn, reg_t pc)
+{
+  return execute_NAME<64, false>(p, insn, pc);
 }
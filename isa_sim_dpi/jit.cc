@@ -0,0 +1,419 @@
+// See LICENSE for license details.
+
+#include "jit.h"
+#include <sys/mman.h>
+#include <cstring>
+#include <vector>
+
+#define RV64_HANDLERS(F) \
+  F(lui) F(auipc) F(jal) F(jalr) \
+  F(beq) F(bne) F(blt) F(bge) F(bltu) F(bgeu) \
+  F(lb) F(lh) F(lw) F(ld) F(lbu) F(lhu) F(lwu) \
+  F(sb) F(sh) F(sw) F(sd) \
+  F(addi) F(slti) F(sltiu) F(xori) F(ori) F(andi) F(slli) F(srli) F(srai) \
+  F(add) F(sub) F(sll) F(slt) F(sltu) F(xor) F(srl) F(sra) F(or) F(and) \
+  F(addiw) F(slliw) F(srliw) F(sraiw) \
+  F(addw) F(subw) F(sllw) F(srlw) F(sraw)
+
+// Translation only happens with the checker off, so blocks hold the
+// unchecked handlers.
+#define DECLARE_HANDLER(name) extern reg_t rv64_##name##_fast(processor_t*, decoded_insn_t, reg_t);
+RV64_HANDLERS(DECLARE_HANDLER)
+#undef DECLARE_HANDLER
+
+jit_t::jit_t(mmu_t* _mmu)
+  : mmu(_mmu), code(NULL), code_used(0), generation(1)
+{
+#if defined(__x86_64__) && !defined(RISCV_ENABLE_COMMITLOG) && !defined(RISCV_ENABLE_HISTOGRAM)
+  void* p = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    fprintf(stderr, "Unable to map JIT code buffer, interpreting instead\n");
+  else
+    code = (uint8_t*)p;
+#endif
+}
+
+jit_t::~jit_t()
+{
+  if (code)
+    munmap(code, CODE_SIZE);
+}
+
+#if defined(__x86_64__)
+
+// Host registers. The generated code is a leaf function: rdi holds the
+// register file and rsi the retired count pointer for its whole body;
+// rax, rcx, r8 and r9 are scratch.
+enum { RAX = 0, RCX = 1, R8 = 8, R9 = 9 };
+
+// x86 condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+// ModRM /digit of the group 1, 2 and 3 opcodes
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum { SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+
+// The parts of the mmu_t TLB that translated code probes directly.
+struct tlb_view_t
+{
+  reg_t* tags[2]; // load, store
+  char** data;
+  reg_t entries;
+};
+
+class x86_block_t
+{
+public:
+  x86_block_t(uint8_t* _buf) : buf(_buf), len(0) {}
+
+  size_t size() { return len; }
+
+  // rax/rcx = x[i]
+  void load_xpr(int r, unsigned i)
+  {
+    if (i == 0)
+      emit(0x31, 0xc0 | r << 3 | r);               // xor r32, r32
+    else
+      emit(0x48, 0x8b, 0x87 | r << 3), d32(8 * i); // mov r, [rdi + 8*i]
+  }
+  // x[i] = rax
+  void store_xpr(unsigned i)
+  {
+    if (i != 0)
+      emit(0x48, 0x89, 0x87), d32(8 * i);          // mov [rdi + 8*i], rax
+  }
+  void mov_imm(int r, int64_t imm)
+  {
+    if (imm == int32_t(imm))
+      emit(0x48, 0xc7, 0xc0 | r), d32(imm);        // mov r, simm32
+    else
+      emit(0x48, 0xb8 | r), q64(imm);              // movabs r, imm64
+  }
+  // rax op= rcx
+  void alu_rr(int op, bool wide = true)
+  {
+    static const uint8_t opcode[] = {0x01, 0x09, 0, 0, 0x21, 0x29, 0x31, 0x39};
+    if (wide)
+      emit(0x48);
+    emit(opcode[op], 0xc8);
+  }
+  // rax op= simm32
+  void alu_ri(int op, int32_t imm, bool wide = true)
+  {
+    if (wide)
+      emit(0x48);
+    emit(0x81, 0xc0 | op << 3), d32(imm);
+  }
+  void shift_ri(int op, unsigned amt, bool wide = true)
+  {
+    if (wide)
+      emit(0x48);
+    emit(0xc1, 0xc0 | op << 3, amt);
+  }
+  // rax op= cl
+  void shift_cl(int op, bool wide = true)
+  {
+    if (wide)
+      emit(0x48);
+    emit(0xd3, 0xc0 | op << 3);
+  }
+  void sign_extend32() { emit(0x48, 0x63, 0xc0); } // movsxd rax, eax
+  void zero_extend32() { emit(0x89, 0xc0); }       // mov eax, eax
+  // rax = flags satisfy cc
+  void setcc(int cc)
+  {
+    emit(0x0f, 0x90 | cc, 0xc0);                   // setcc al
+    emit(0x0f, 0xb6, 0xc0);                        // movzx eax, al
+  }
+  // jump to a 32-bit displacement patched later; returns its offset
+  size_t jcc(int cc)
+  {
+    emit(0x0f, 0x80 | cc), d32(0);
+    return len - 4;
+  }
+  void patch(size_t at, size_t target)
+  {
+    int32_t rel = target - (at + 4);
+    memcpy(buf + at, &rel, sizeof(rel));
+  }
+  // *retired = count; return pc
+  void exit(size_t count, reg_t pc)
+  {
+    emit(0x48, 0xc7, 0x06), d32(count);            // mov qword [rsi], count
+    emit(0x48, 0xb8), q64(pc);                     // movabs rax, pc
+    emit(0xc3);                                    // ret
+  }
+
+  // Turn the virtual address in rax into a host pointer through the TLB
+  // entry that mmu_t::translate() would hit. The jumps taken when it
+  // would not are added to 'misses'.
+  void translate(const tlb_view_t& tlb, bool store, unsigned bytes, std::vector<size_t>& misses)
+  {
+    if (bytes > 1)
+    {
+      emit(0x48, 0xa9), d32(bytes - 1);            // test rax, bytes-1
+      misses.push_back(jcc(CC_NE));
+    }
+    emit(0x48, 0x89, 0xc1);                        // mov rcx, rax
+    emit(0x48, 0xc1, 0xe9, PGSHIFT);               // shr rcx, PGSHIFT
+    emit(0x49, 0x89, 0xc8);                        // mov r8, rcx
+    emit(0x49, 0x81, 0xe0), d32(tlb.entries - 1);  // and r8, entries-1
+    emit(0x49, 0xb9), q64((uint64_t)tlb.tags[store]); // movabs r9, tags
+    emit(0x4b, 0x39, 0x0c, 0xc1);                  // cmp [r9 + r8*8], rcx
+    misses.push_back(jcc(CC_NE));
+    emit(0x49, 0xb9), q64((uint64_t)tlb.data);     // movabs r9, data
+    emit(0x4b, 0x03, 0x04, 0xc1);                  // add rax, [r9 + r8*8]
+  }
+
+  template <typename... T>
+  void emit(T... bytes)
+  {
+    uint8_t b[] = {uint8_t(bytes)...};
+    memcpy(buf + len, b, sizeof(b));
+    len += sizeof(b);
+  }
+  void d32(uint32_t x) { memcpy(buf + len, &x, 4); len += 4; }
+  void q64(uint64_t x) { memcpy(buf + len, &x, 8); len += 8; }
+
+private:
+  uint8_t* buf;
+  size_t len;
+};
+
+enum translate_result_t { TR_UNSUPPORTED, TR_OK, TR_END };
+
+// Emit code for one instruction at 'pc'. Any jumps to the point where
+// the interpreter has to take over this instruction are added to
+// 'misses'. Control transfers emit their own exits and return TR_END.
+static translate_result_t translate_insn(x86_block_t& e, const tlb_view_t& tlb,
+                                         insn_fetch_t fetch, reg_t pc, size_t retired,
+                                         std::vector<size_t>& misses)
+{
+  insn_t insn = fetch.insn;
+  insn_func_t f = fetch.func;
+  int32_t imm = insn.i_imm();
+  unsigned rd = insn.rd(), rs1 = insn.rs1(), rs2 = insn.rs2();
+
+  #define IS(name) (f == rv64_##name##_fast)
+
+  // register-immediate
+  int op = IS(addi) ? ALU_ADD : IS(xori) ? ALU_XOR : IS(ori) ? ALU_OR : IS(andi) ? ALU_AND : -1;
+  if (op >= 0)
+  {
+    e.load_xpr(RAX, rs1);
+    e.alu_ri(op, imm);
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  if (IS(slti) || IS(sltiu))
+  {
+    e.load_xpr(RAX, rs1);
+    e.alu_ri(ALU_CMP, imm);
+    e.setcc(IS(slti) ? CC_L : CC_B);
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  op = IS(slli) ? SH_SHL : IS(srli) ? SH_SHR : IS(srai) ? SH_SAR : -1;
+  if (op >= 0)
+  {
+    e.load_xpr(RAX, rs1);
+    e.shift_ri(op, imm & 0x3f);
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  if (IS(addiw))
+  {
+    e.load_xpr(RAX, rs1);
+    e.alu_ri(ALU_ADD, imm, false);
+    e.sign_extend32();
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  // The 32-bit immediate shifts allow amounts up to 63, so shift the
+  // extended value as 64 bits like the handlers do.
+  op = IS(slliw) ? SH_SHL : IS(srliw) ? SH_SHR : IS(sraiw) ? SH_SAR : -1;
+  if (op >= 0)
+  {
+    e.load_xpr(RAX, rs1);
+    if (op == SH_SHR)
+      e.zero_extend32();
+    else if (op == SH_SAR)
+      e.sign_extend32();
+    e.shift_ri(op, imm & 0x3f);
+    e.sign_extend32();
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+
+  // register-register
+  op = IS(add) ? ALU_ADD : IS(sub) ? ALU_SUB : IS(xor) ? ALU_XOR : IS(or) ? ALU_OR : IS(and) ? ALU_AND : -1;
+  bool word = IS(addw) || IS(subw);
+  if (word)
+    op = IS(addw) ? ALU_ADD : ALU_SUB;
+  if (op >= 0)
+  {
+    e.load_xpr(RAX, rs1);
+    e.load_xpr(RCX, rs2);
+    e.alu_rr(op, !word);
+    if (word)
+      e.sign_extend32();
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  if (IS(slt) || IS(sltu))
+  {
+    e.load_xpr(RAX, rs1);
+    e.load_xpr(RCX, rs2);
+    e.alu_rr(ALU_CMP);
+    e.setcc(IS(slt) ? CC_L : CC_B);
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+  // x86 masks the shift count in cl to 6 bits, or 5 for 32-bit shifts,
+  // which matches RV64.
+  op = IS(sll) || IS(sllw) ? SH_SHL : IS(srl) || IS(srlw) ? SH_SHR : IS(sra) || IS(sraw) ? SH_SAR : -1;
+  if (op >= 0)
+  {
+    word = IS(sllw) || IS(srlw) || IS(sraw);
+    e.load_xpr(RAX, rs1);
+    e.load_xpr(RCX, rs2);
+    e.shift_cl(op, !word);
+    if (word)
+      e.sign_extend32();
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+
+  if (IS(lui) || IS(auipc))
+  {
+    e.mov_imm(RAX, insn.u_imm() + (IS(auipc) ? pc : 0));
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+
+  // loads and stores
+  int bytes = IS(lb) || IS(lbu) || IS(sb) ? 1 : IS(lh) || IS(lhu) || IS(sh) ? 2 :
+              IS(lw) || IS(lwu) || IS(sw) ? 4 : IS(ld) || IS(sd) ? 8 : 0;
+  if (bytes)
+  {
+    bool store = IS(sb) || IS(sh) || IS(sw) || IS(sd);
+    e.load_xpr(RAX, rs1);
+    e.alu_ri(ALU_ADD, store ? insn.s_imm() : imm);
+    e.translate(tlb, store, bytes, misses);
+    if (store)
+    {
+      e.load_xpr(RCX, rs2);
+      switch (bytes)
+      {
+        case 1: e.emit(0x88, 0x08); break;               // mov [rax], cl
+        case 2: e.emit(0x66, 0x89, 0x08); break;         // mov [rax], cx
+        case 4: e.emit(0x89, 0x08); break;               // mov [rax], ecx
+        case 8: e.emit(0x48, 0x89, 0x08); break;         // mov [rax], rcx
+      }
+      return TR_OK;
+    }
+    if (IS(lb))       e.emit(0x48, 0x0f, 0xbe, 0x00);    // movsx rax, byte [rax]
+    else if (IS(lbu)) e.emit(0x0f, 0xb6, 0x00);          // movzx eax, byte [rax]
+    else if (IS(lh))  e.emit(0x48, 0x0f, 0xbf, 0x00);    // movsx rax, word [rax]
+    else if (IS(lhu)) e.emit(0x0f, 0xb7, 0x00);          // movzx eax, word [rax]
+    else if (IS(lw))  e.emit(0x48, 0x63, 0x00);          // movsxd rax, [rax]
+    else if (IS(lwu)) e.emit(0x8b, 0x00);                // mov eax, [rax]
+    else              e.emit(0x48, 0x8b, 0x00);          // mov rax, [rax]
+    e.store_xpr(rd);
+    return TR_OK;
+  }
+
+  // control transfers end the block
+  int cc = IS(beq) ? CC_E : IS(bne) ? CC_NE : IS(blt) ? CC_L : IS(bge) ? CC_GE :
+           IS(bltu) ? CC_B : IS(bgeu) ? CC_AE : -1;
+  if (cc >= 0)
+  {
+    e.load_xpr(RAX, rs1);
+    e.load_xpr(RCX, rs2);
+    e.alu_rr(ALU_CMP);
+    size_t taken = e.jcc(cc);
+    e.exit(retired + 1, pc + 4);
+    e.patch(taken, e.size());
+    e.exit(retired + 1, pc + insn.sb_imm());
+    return TR_END;
+  }
+  if (IS(jal))
+  {
+    e.mov_imm(RAX, pc + 4);
+    e.store_xpr(rd);
+    e.exit(retired + 1, pc + insn.uj_imm());
+    return TR_END;
+  }
+  if (IS(jalr))
+  {
+    e.load_xpr(RCX, rs1);
+    e.mov_imm(RAX, pc + 4);
+    e.store_xpr(rd);
+    e.emit(0x48, 0x89, 0xc8);                      // mov rax, rcx
+    e.alu_ri(ALU_ADD, imm);
+    e.alu_ri(ALU_AND, -2);
+    e.emit(0x48, 0xc7, 0x06), e.d32(retired + 1);  // mov qword [rsi], retired+1
+    e.emit(0xc3);                                  // ret
+    return TR_END;
+  }
+
+  #undef IS
+  return TR_UNSUPPORTED;
+}
+
+jit_code_t jit_t::translate(bb_entry_t* bb)
+{
+  if (!code)
+    return NULL;
+
+  if (code_used + MAX_BLOCK_CODE > CODE_SIZE)
+  {
+    // Recycle the buffer. Every translation made so far goes stale.
+    code_used = 0;
+    generation++;
+  }
+
+  tlb_view_t tlb = {{mmu->tlb_load_tag, mmu->tlb_store_tag}, mmu->tlb_data, mmu_t::TLB_ENTRIES};
+  uint8_t* start = code + code_used;
+  x86_block_t e(start);
+  std::vector<size_t> misses[bb_entry_t::BB_MAX_INSNS];
+
+  size_t i;
+  reg_t pc = bb->tag;
+  translate_result_t result = TR_OK;
+  for (i = 0; i < bb->len && result == TR_OK; i++, pc += 4)
+  {
+    if (insn_length(bb->insns[i].insn.bits()) != 4)
+      break;
+    result = translate_insn(e, tlb, bb->insns[i], pc, i, misses[i]);
+    if (result == TR_UNSUPPORTED)
+      break;
+  }
+  if (i == 0)
+    return NULL;
+  if (result != TR_END)
+    e.exit(i, pc);
+
+  // Hand instruction j back to the interpreter when it misses.
+  for (size_t j = 0; j < i; j++)
+  {
+    if (misses[j].empty())
+      continue;
+    for (size_t k = 0; k < misses[j].size(); k++)
+      e.patch(misses[j][k], e.size());
+    e.exit(j, bb->tag + 4 * j);
+  }
+
+  code_used = (code_used + e.size() + 15) & ~size_t(15);
+  return (jit_code_t)start;
+}
+
+#else
+
+jit_code_t jit_t::translate(bb_entry_t* bb)
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,51 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_JIT_H
+#define _RISCV_JIT_H
+
+#include "mmu.h"
+
+// Dynamic binary translator for fast-forwarding.
+//
+// Basic blocks that have been run HOT_THRESHOLD times are translated
+// into x86-64 host code. Translation covers RV64 integer ALU
+// instructions, branches, jumps, and loads and stores that hit in the
+// mmu_t TLB. Host code stops at the first instruction it cannot run
+// (CSR, FP, AMO, anything that may trap) and returns how many
+// instructions it retired, so the interpreter can carry on from there
+// with the regular insn_func_t handlers. Translated code never traps and
+// never touches the debug buffer, so it is only used with the checker
+// off. On other hosts translate() always declines.
+class jit_t
+{
+public:
+  jit_t(mmu_t* _mmu);
+  ~jit_t();
+
+  // Return host code for 'bb', translating it once it is hot.
+  // Returns NULL if the block should be interpreted.
+  jit_code_t lookup(bb_entry_t* bb)
+  {
+    if (likely(bb->jit_gen == generation))
+      return bb->jit;
+    if (++bb->heat < HOT_THRESHOLD)
+      return NULL;
+    bb->jit = translate(bb);
+    bb->jit_gen = generation;
+    return bb->jit;
+  }
+
+private:
+  static const unsigned HOT_THRESHOLD = 16;
+  static const size_t CODE_SIZE = 16 << 20;
+  static const size_t MAX_BLOCK_CODE = 4096; // upper bound for one block
+
+  mmu_t* mmu;
+  uint8_t* code;      // executable code buffer
+  size_t code_used;
+  uint64_t generation; // bumped when the code buffer is recycled
+
+  jit_code_t translate(bb_entry_t* bb);
+};
+
+#endif
@@ -3,32 +3,222 @@
 #include "mmu.h"
 #include "sim.h"
 #include "processor.h"
+#include "trace.h"
+#include "fusion.h"
 
 mmu_t::mmu_t(char* _mem, size_t _memsz)
- : mem(_mem), memsz(_memsz), proc(NULL)
+ : mem(_mem), memsz(_memsz), proc(NULL), icache(NULL), icache_victim(NULL),
+   bb_cache(NULL), bb_epoch(0), fusion(false), l2_tlb(NULL), l2_tlb_victim(NULL),
+   asid(0)
 {
-  flush_tlb();
+  configure_icache(ICACHE_SITES, 1);
+  configure_tlb(1024, 4);
   debug_mmu = false;
 }
 
 mmu_t::mmu_t(char* _mem, size_t _memsz, bool _debug_mmu)
- : mem(_mem), memsz(_memsz), proc(NULL)
+ : mem(_mem), memsz(_memsz), proc(NULL), icache(NULL), icache_victim(NULL),
+   bb_cache(NULL), bb_epoch(0), fusion(false), l2_tlb(NULL), l2_tlb_victim(NULL),
+   asid(0)
 {
-  flush_tlb();
+  configure_icache(ICACHE_SITES, 1);
+  configure_tlb(1024, 4);
   debug_mmu = _debug_mmu; // Set flag to true if this is a debug MMU
 }
 
 mmu_t::~mmu_t()
 {
+  delete [] icache;
+  delete [] icache_victim;
+  delete [] bb_cache;
+  delete [] l2_tlb;
+  delete [] l2_tlb_victim;
+}
+
+void mmu_t::configure_icache(size_t entries, size_t ways)
+{
+  if (!valid_geometry(entries, ways, ICACHE_MAX_WAYS))
+    throw std::invalid_argument("bad decode cache geometry");
+
+  delete [] icache;
+  delete [] icache_victim;
+  icache_sets = entries / ways;
+  icache_ways = ways;
+  icache = new icache_entry_t[entries + 1];
+  icache_victim = new uint8_t[icache_sets]();
+  icache_hits = icache_misses = 0;
+  flush_icache();
 }
 
 void mmu_t::flush_icache()
 {
-  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+  for (size_t i = 0; i <= icache_sets * icache_ways; i++)
     icache[i].tag = -1;
+
+  // Invalidates every basic block, including the chain pointers into them.
+  bb_epoch++;
+}
+
+icache_entry_t* mmu_t::refill_icache(reg_t addr)
+{
+  // Ways are replaced round-robin.
+  size_t set = icache_index(addr);
+  icache_entry_t* entry = &icache[(icache_victim[set] & (icache_ways-1)) * icache_sets + set];
+  icache_victim[set]++;
+  icache_misses++;
+
+  bool rvc = false; // set this dynamically once RVC is re-implemented
+  char* iaddr = (char*)translate(addr, rvc ? 2 : 4, false, true);
+  insn_bits_t insn = *(uint16_t*)iaddr;
+
+  if (unlikely(insn_length(insn) == 2)) {
+    insn = (int16_t)insn;
+  } else if (likely(insn_length(insn) == 4)) {
+    if (likely((addr & (PGSIZE-1)) < PGSIZE-2))
+      insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
+    else
+      insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 2, false, true) << 16;
+  } else if (insn_length(insn) == 6) {
+    insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 2, false, true) << 32;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
+  } else {
+    static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
+    insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 2, false, true) << 48;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 2, false, true) << 32;
+    insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
+  }
+
+  insn_fetch_t fetch = {proc->decode_insn(insn), insn_t(insn)};
+  entry->tag = addr;
+  entry->data = fetch;
+
+  reg_t paddr = iaddr - mem;
+  if (!tracer.empty() && tracer.interested_in_range(paddr, paddr + 1, false, true))
+  {
+    entry->tag = -1;
+    tracer.trace(paddr, 1, false, true);
+  }
+  return entry;
+}
+
+bool mmu_t::try_refill_icache(reg_t addr, icache_entry_t** entry, reg_t* cause)
+{
+  void* host;
+  if (!try_translate(addr, 4, false, true, &host, cause))
+    return false;
+
+  // The first parcel is mapped now, so only the later parcels of an
+  // instruction longer than 32 bits that crosses a page can still fault.
+  try {
+    *entry = refill_icache(addr);
+  } catch (trap_t& t) {
+    *cause = t.cause();
+    return false;
+  }
+  return true;
+}
+
+// Instructions after which the next PC may not be sequential, or which
+// may change translation or the code itself.
+static bool ends_bb(insn_t insn)
+{
+  switch (insn.bits() & 0x7f)
+  {
+    case 0x63: // BRANCH
+    case 0x67: // JALR
+    case 0x6f: // JAL
+    case 0x73: // SYSTEM
+    case 0x0f: // MISC-MEM (fence.i)
+      return true;
+  }
+  return false;
+}
+
+bb_entry_t* mmu_t::access_bb(reg_t addr)
+{
+  if (unlikely(!bb_cache))
+  {
+    bb_cache = new bb_entry_t[BB_ENTRIES];
+    for (size_t i = 0; i < BB_ENTRIES; i++)
+      bb_cache[i].tag = -1;
+  }
+
+  bb_entry_t* bb = &bb_cache[(addr / 4) % BB_ENTRIES];
+  if (likely(bb_valid(bb, addr)))
+    return bb;
+
+  bb->tag = -1;
+  bb->len = 0;
+  bb->succ[0] = bb->succ[1] = NULL;
+  bb->jit = NULL;
+  bb->jit_gen = 0;
+  bb->heat = 0;
+
+  // Only the first fetch may fault; a later fault just ends the block
+  // and is taken when execution gets there.
+  reg_t pc = addr;
+  insn_fetch_t fetch = load_insn(pc);
+  while (true)
+  {
+    bb->insns[bb->len++] = fetch;
+    pc += insn_length(fetch.insn.bits());
+    if (ends_bb(fetch.insn) || bb->len == bb_entry_t::BB_MAX_INSNS || (pc & (PGSIZE-1)) == 0)
+      break;
+    try {
+      fetch = load_insn(pc);
+    } catch (trap_t& t) {
+      break;
+    }
+  }
+
+  // A slot starts at most one pair and is part of at most one.
+  for (size_t i = 0; i < bb->len; i++)
+    bb->fused[i] = NULL;
+  if (fusion)
+    for (size_t i = 0; i + 1 < bb->len; i++)
+      if ((bb->fused[i] = fuse_insns(bb->insns[i], bb->insns[i+1])))
+        i++;
+
+  bb->tag = addr;
+  bb->end = pc;
+  bb->epoch = bb_epoch;
+  return bb;
+}
+
+void mmu_t::configure_tlb(size_t entries, size_t ways)
+{
+  if (!valid_geometry(entries, ways, TLB_MAX_WAYS))
+    throw std::invalid_argument("bad TLB geometry");
+
+  delete [] l2_tlb;
+  delete [] l2_tlb_victim;
+  l2_tlb_sets = entries / ways;
+  l2_tlb_ways = ways;
+  l2_tlb = new tlb_entry_t[entries];
+  l2_tlb_victim = new uint8_t[l2_tlb_sets]();
+  memset(&tlb_stats, 0, sizeof(tlb_stats));
+  flush_tlb();
+}
+
+void mmu_t::set_asid(reg_t value)
+{
+  // Only the untagged structures can hold translations of the old ASID.
+  if (value != asid)
+    flush_tlb_untagged();
+  asid = value;
 }
 
 void mmu_t::flush_tlb()
+{
+  for (size_t i = 0; i < l2_tlb_sets * l2_tlb_ways; i++)
+    l2_tlb[i].vpn = -1;
+  for (size_t i = 0; i < WALK_CACHE_ENTRIES; i++)
+    walk_cache[i].tag = -1;
+
+  flush_tlb_untagged();
+}
+
+void mmu_t::flush_tlb_untagged()
 {
   memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
   memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
@@ -38,9 +228,26 @@ void mmu_t::flush_tlb()
 }
 
 void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
+{
+  void* host;
+  reg_t cause;
+  if (unlikely(!try_refill_tlb(addr, bytes, store, fetch, &host, &cause)))
+  {
+    if (fetch)
+      throw trap_instruction_access_fault(addr);
+    if (store)
+      throw trap_store_access_fault(addr);
+    throw trap_load_access_fault(addr);
+  }
+  return host;
+}
+
+bool mmu_t::try_refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch,
+                           void** host, reg_t* cause)
 {
   reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
   reg_t expected_tag = addr >> PGSHIFT;
+  tlb_stats.misses++;
 
   reg_t pte = walk(addr);
 
@@ -50,15 +257,12 @@ void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
   pte_perm |= pte & PTE_V;
 
   reg_t perm = (fetch ? PTE_UX : store ? PTE_UW : PTE_UR) | PTE_V;
-  ifprintf(logging_on,stderr,"PTE Perm 0x%" PRIxreg "  Perm 0x%" PRIxreg "\n",pte_perm,perm);
+  TRACE(TE_PTE_PERM, proc ? proc->id : 0, 0, pte_perm, perm, 0);
 
   if(unlikely((pte_perm & perm) != perm))
   {
-    if (fetch)
-      throw trap_instruction_access_fault(addr);
-    if (store)
-      throw trap_store_access_fault(addr);
-    throw trap_load_access_fault(addr);
+    *cause = fetch ? CAUSE_FAULT_FETCH : store ? CAUSE_FAULT_STORE : CAUSE_FAULT_LOAD;
+    return false;
   }
 
   reg_t pgoff = addr & (PGSIZE-1);
@@ -75,7 +279,8 @@ void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
     tlb_data[idx] = mem + pgbase - (addr & ~(PGSIZE-1));
   }
 
-  return mem + paddr;
+  *host = mem + paddr;
+  return true;
 }
 
 pte_t mmu_t::walk(reg_t addr)
@@ -93,37 +298,89 @@ pte_t mmu_t::walk(reg_t addr)
   }
   else
   {
-    reg_t base = proc->get_state()->ptbr;
-    reg_t ptd;
+    reg_t vpn = addr >> PGSHIFT;
+    reg_t root = proc->get_state()->ptbr;
+    tlb_entry_t* set = &l2_tlb[(vpn & (l2_tlb_sets-1)) * l2_tlb_ways];
+    for (size_t way = 0; way < l2_tlb_ways; way++)
+    {
+      if (set[way].vpn == vpn && set[way].asid == asid && set[way].root == root)
+      {
+        tlb_stats.l2_hits++;
+        return set[way].pte;
+      }
+    }
+
+    pte = walk_page_table(addr, root);
 
-    int ptshift = (LEVELS-1)*PTIDXBITS;
-    for(reg_t i = 0; i < LEVELS; i++, ptshift -= PTIDXBITS)
+    // Only valid mappings are kept; a fault walks again next time.
+    if (pte)
     {
-      reg_t idx = (addr >> (PGSHIFT+ptshift)) & ((1<<PTIDXBITS)-1);
+      uint8_t& victim = l2_tlb_victim[vpn & (l2_tlb_sets-1)];
+      tlb_entry_t* entry = &set[victim++ & (l2_tlb_ways-1)];
+      entry->vpn = vpn;
+      entry->asid = asid;
+      entry->root = root;
+      entry->pte = pte;
+    }
+  }
+
+  return pte;
+}
+
+pte_t mmu_t::walk_page_table(reg_t addr, reg_t root)
+{
+  pte_t pte = 0;
+  reg_t vpn = addr >> PGSHIFT;
+  reg_t base = root;
+  reg_t ptd;
+  reg_t i = 0;
+  int ptshift = (LEVELS-1)*PTIDXBITS;
+  tlb_stats.walks++;
+
+  // start at the last-level page table if the walk cache knows it
+  walk_cache_entry_t* wc = &walk_cache[(vpn >> PTIDXBITS) % WALK_CACHE_ENTRIES];
+  if (wc->tag == vpn >> PTIDXBITS && wc->asid == asid && wc->root == root)
+  {
+    tlb_stats.walk_cache_hits++;
+    base = wc->base;
+    i = LEVELS-1;
+    ptshift = 0;
+  }
 
-      reg_t pte_addr = base + idx*sizeof(pte_t);
-      if(pte_addr >= memsz)
-        break;
+  for(; i < LEVELS; i++, ptshift -= PTIDXBITS)
+  {
+    reg_t idx = (addr >> (PGSHIFT+ptshift)) & ((1<<PTIDXBITS)-1);
 
-      ptd = *(pte_t*)(mem+pte_addr);
+    reg_t pte_addr = base + idx*sizeof(pte_t);
+    if(pte_addr >= memsz)
+      break;
 
-      if (!(ptd & PTE_V)) // invalid mapping
-        break;
-      else if (ptd & PTE_T) // next level of page table
-        base = (ptd >> PGSHIFT) << PGSHIFT;
-      else // the actual PTE
+    ptd = *(pte_t*)(mem+pte_addr);
+
+    if (!(ptd & PTE_V)) // invalid mapping
+      break;
+    else if (ptd & PTE_T) // next level of page table
+    {
+      base = (ptd >> PGSHIFT) << PGSHIFT;
+      if (i == LEVELS-2)
       {
-        // if this PTE is from a larger PT, fake a leaf
-        // PTE so the TLB will work right
-        reg_t vpn = addr >> PGSHIFT;
-        ptd |= (vpn & ((1<<(ptshift))-1)) << PGSHIFT;
-
-        // fault if physical addr is out of range
-        if (((ptd >> PGSHIFT) << PGSHIFT) < memsz)
-          pte = ptd;
-        break;
+        wc->tag = vpn >> PTIDXBITS;
+        wc->asid = asid;
+        wc->root = root;
+        wc->base = base;
       }
     }
+    else // the actual PTE
+    {
+      // if this PTE is from a larger PT, fake a leaf
+      // PTE so the TLB will work right
+      ptd |= (vpn & ((1<<(ptshift))-1)) << PGSHIFT;
+
+      // fault if physical addr is out of range
+      if (((ptd >> PGSHIFT) << PGSHIFT) < memsz)
+        pte = ptd;
+      break;
+    }
   }
 
   return pte;
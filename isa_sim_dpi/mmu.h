@@ -34,6 +34,59 @@ struct icache_entry_t {
   insn_fetch_t data;
 };
 
+// A second-level TLB entry: the leaf PTE for 'vpn' in the address space
+// given by 'asid' and the page table root 'root'.
+struct tlb_entry_t {
+  reg_t vpn; // -1 if invalid
+  reg_t asid;
+  reg_t root;
+  pte_t pte;
+};
+
+// A page-walk cache entry: the last-level page table for the VPNs whose
+// upper bits are 'tag'.
+struct walk_cache_entry_t {
+  reg_t tag; // -1 if invalid
+  reg_t asid;
+  reg_t root;
+  reg_t base;
+};
+
+struct tlb_stats_t {
+  uint64_t misses;          // first-level TLB refills
+  uint64_t l2_hits;
+  uint64_t walks;
+  uint64_t walk_cache_hits; // walks that started at the last level
+};
+
+// Host code for a basic block (see jit.h). Runs the block on the integer
+// register file 'xpr', stores the number of instructions retired to
+// 'retired' and returns the PC to continue at.
+typedef reg_t (*jit_code_t)(reg_t* xpr, size_t* retired);
+
+// Handler for a fused pair of instructions (see fusion.h). Runs both and
+// returns the PC after the second.
+typedef reg_t (*fused_func_t)(processor_t* p, const insn_fetch_t* pair, reg_t pc);
+
+// A basic block of pre-decoded instructions, used to fast-forward without
+// an icache lookup per instruction. A block ends at a control transfer,
+// SYSTEM or MISC-MEM instruction, at a page boundary or after
+// BB_MAX_INSNS instructions. Blocks are chained to the blocks that
+// followed them last time, for the fall-through and the taken path.
+struct bb_entry_t {
+  static const size_t BB_MAX_INSNS = 16;
+  reg_t tag;              // PC of the first instruction
+  reg_t end;              // PC following the last instruction
+  uint64_t epoch;         // valid only while equal to mmu_t::bb_epoch
+  size_t len;
+  bb_entry_t* succ[2];    // successor for the fall-through [0] and taken [1] path
+  jit_code_t jit;         // translation, valid only while jit_gen is current
+  uint64_t jit_gen;
+  unsigned heat;          // executions counted towards translation
+  insn_fetch_t insns[BB_MAX_INSNS];
+  fused_func_t fused[BB_MAX_INSNS]; // handler for the pair starting at each slot, or NULL
+};
+
 // this class implements a processor's port into the virtual memory system.
 // an MMU and instruction cache are maintained for simulator performance.
 class mmu_t
@@ -54,12 +107,13 @@ public:
     #undef load_func
     // template for functions that load an aligned value from memory
     #define load_func(type) \
-      type##_t load_##type(reg_t addr) __attribute__((always_inline)) { \
+      template <bool CHECKER = true> __attribute__((always_inline)) \
+      type##_t load_##type(reg_t addr) { \
         /* Must push addr before translation as translation may cause exception*/ \
-        if((!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_address_actual(addr, MSRC_OPERAND, proc->get_state()->pc, 0, 0); } \
+        if(CHECKER && (!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_address_actual(addr, MSRC_OPERAND, proc->get_state()->pc, 0, 0); } \
         void* paddr = translate(addr, sizeof(type##_t), false, false); \
         type##_t rdata = *(type##_t*)paddr; \
-        if((!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_load_data_actual(addr, MSRC_OPERAND, proc->get_state()->pc, (reg_t)rdata, 0); } \
+        if(CHECKER && (!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_load_data_actual(addr, MSRC_OPERAND, proc->get_state()->pc, (reg_t)rdata, 0); } \
         return rdata; \
       }
   #endif
@@ -93,14 +147,15 @@ public:
     #undef store_func
     // template for functions that load an aligned value from memory
     #define store_func(type) \
+      template <bool CHECKER = true> \
       void store_##type(reg_t addr, type##_t val) { \
         /* Only push addr and data if this is not and HTIF port to MMU and this is the ISA sim MMU*/  \
         /* Must push addr before translation as translation may cause exception*/ \
-        if((!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_address_actual(addr, MDST_OPERAND, proc->get_state()->pc, 0, 0); } \
+        if(CHECKER && (!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_address_actual(addr, MDST_OPERAND, proc->get_state()->pc, 0, 0); } \
         void* paddr = translate(addr, sizeof(type##_t), true, false); \
         *(type##_t*)paddr = val; \
         /* Only push addr and data if this is not and HTIF port to MMU and this is the ISA sim MMU*/  \
-        if((!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_store_data_actual(addr, MDST_OPERAND, proc->get_state()->pc, *(type##_t*)paddr, 0); }  \
+        if(CHECKER && (!debug_mmu) && proc->get_checker()){ proc->get_pipe()->push_store_data_actual(addr, MDST_OPERAND, proc->get_state()->pc, *(type##_t*)paddr, 0); }  \
       }
   #endif
 
@@ -117,54 +172,89 @@ public:
   //  //fprintf(stderr,"Storing addr 0x%" PRIxreg " paddr 0x%" PRIxreg "\n",addr,(reg_t)paddr);
   //}
 
-  static const reg_t ICACHE_ENTRIES = 1024;
+  // The decode cache (icache) is set-associative, with 'ways' ways of
+  // entries/ways sets each, both powers of two. Way w of set s is entry
+  // w*sets + s, so sequential PCs in a way are adjacent. processor_t::step
+  // has ICACHE_SITES dispatch sites and entry i uses site i % ICACHE_SITES.
+  static const reg_t ICACHE_SITES = 1024;
+  static const reg_t ICACHE_MAX_WAYS = 8;
+  void configure_icache(size_t entries, size_t ways);
+  // The shape check configure_icache() and configure_tlb() apply, so that
+  // option parsers can reject a bad geometry up front.
+  static bool valid_geometry(size_t entries, size_t ways, size_t max_ways)
+  {
+    return entries != 0 && !(entries & (entries-1)) && ways != 0 && !(ways & (ways-1)) &&
+           ways <= entries && ways <= max_ways;
+  }
+  uint64_t icache_hit_count() { return icache_hits; }
+  uint64_t icache_miss_count() { return icache_misses; }
 
   inline size_t icache_index(reg_t addr)
   {
     // for instruction sizes != 4, this hash still works but is suboptimal
-    return (addr / 4) % ICACHE_ENTRIES;
+    return (addr / 4) & (icache_sets - 1);
+  }
+
+  // return the icache entry for 'addr', or NULL on a miss
+  icache_entry_t* probe_icache(reg_t addr) __attribute__((always_inline))
+  {
+    icache_entry_t* entry = &icache[icache_index(addr)];
+    for (size_t way = 0; way < icache_ways; way++, entry += icache_sets)
+    {
+      if (likely(entry->tag == addr))
+      {
+        icache_hits++;
+        return entry;
+      }
+    }
+    return NULL;
   }
 
   // load instruction from memory at aligned address.
   icache_entry_t* access_icache(reg_t addr) __attribute__((always_inline))
   {
-    reg_t idx = icache_index(addr);
-    icache_entry_t* entry = &icache[idx];
-    if (likely(entry->tag == addr))
-      return entry;
-
-    bool rvc = false; // set this dynamically once RVC is re-implemented
-    char* iaddr = (char*)translate(addr, rvc ? 2 : 4, false, true);
-    insn_bits_t insn = *(uint16_t*)iaddr;
-
-    if (unlikely(insn_length(insn) == 2)) {
-      insn = (int16_t)insn;
-    } else if (likely(insn_length(insn) == 4)) {
-      if (likely((addr & (PGSIZE-1)) < PGSIZE-2))
-        insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
-      else
-        insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 2, false, true) << 16;
-    } else if (insn_length(insn) == 6) {
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 2, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
-    } else {
-      static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 2, false, true) << 48;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 2, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
-    }
+    icache_entry_t* entry = probe_icache(addr);
+    return likely(entry != NULL) ? entry : refill_icache(addr);
+  }
+
+  // Status-returning forms of access_icache(), translate() and the loads
+  // and stores, for callers that expect faults, such as wrong-path
+  // accesses from the RTL. They return false and set *cause instead of
+  // throwing, and never push to the debug buffer. Loads zero-extend.
+  bool try_access_icache(reg_t addr, icache_entry_t** entry, reg_t* cause)
+  {
+    *entry = probe_icache(addr);
+    return likely(*entry != NULL) || try_refill_icache(addr, entry, cause);
+  }
 
-    insn_fetch_t fetch = {proc->decode_insn(insn), insn};
-    icache[idx].tag = addr;
-    icache[idx].data = fetch;
+  bool try_load(reg_t addr, size_t size, uint64_t* val, reg_t* cause)
+  {
+    void* host;
+    if (unlikely(!try_translate(addr, size, false, false, &host, cause)))
+      return false;
+    switch (size)
+    {
+      case 1: *val = *(uint8_t*)host; break;
+      case 2: *val = *(uint16_t*)host; break;
+      case 4: *val = *(uint32_t*)host; break;
+      default: *val = *(uint64_t*)host; break;
+    }
+    return true;
+  }
 
-    reg_t paddr = iaddr - mem;
-    if (!tracer.empty() && tracer.interested_in_range(paddr, paddr + 1, false, true))
+  bool try_store(reg_t addr, size_t size, uint64_t val, reg_t* cause)
+  {
+    void* host;
+    if (unlikely(!try_translate(addr, size, true, false, &host, cause)))
+      return false;
+    switch (size)
     {
-      icache[idx].tag = -1;
-      tracer.trace(paddr, 1, false, true);
+      case 1: *(uint8_t*)host = val; break;
+      case 2: *(uint16_t*)host = val; break;
+      case 4: *(uint32_t*)host = val; break;
+      default: *(uint64_t*)host = val; break;
     }
-    return &icache[idx];
+    return true;
   }
 
   inline insn_fetch_t load_insn(reg_t addr)
@@ -172,9 +262,44 @@ public:
     return access_icache(addr)->data;
   }
 
+  // Return the basic block starting at 'addr', building it on a miss.
+  // A fetch fault on the first instruction is thrown as usual.
+  bb_entry_t* access_bb(reg_t addr);
+
+  bool bb_valid(bb_entry_t* bb, reg_t addr)
+  {
+    return bb && bb->tag == addr && bb->epoch == bb_epoch;
+  }
+
+  // Memory tracers must see every fetch, which blocks would hide.
+  bool bb_enabled() { return tracer.empty(); }
+
+  // Fuse common instruction pairs in basic blocks.
+  void set_fusion(bool value)
+  {
+    if (value != fusion)
+      flush_icache();
+    fusion = value;
+  }
+
   void set_processor(processor_t* p) { proc = p; flush_tlb(); }
 
+  // Translations are cached in two levels. The direct-mapped TLB probed
+  // by translate() (and by translated code) is refilled from a
+  // set-associative second-level TLB, then from page table walks that
+  // start from a page-walk cache when they can. The second level and the
+  // walk cache are only used with SR_VM set. Their entries are tagged
+  // with the ASID and page table root, so only flush_tlb() drops them.
+  // The second level has 'entries' entries of 'ways' ways each, both
+  // powers of two.
+  static const reg_t TLB_MAX_WAYS = 8;
+  void configure_tlb(size_t entries, size_t ways);
+  const tlb_stats_t& get_tlb_stats() { return tlb_stats; }
+  void set_asid(reg_t value);
+  reg_t get_asid() { return asid; }
+
   void flush_tlb();
+  void flush_tlb_untagged(); // the first level and the icache only
   void flush_icache();
 
   void register_memtracer(memtracer_t*);
@@ -188,7 +313,18 @@ private:
   bool debug_mmu; //Set to true if this is a debug MMU
 
   // implement an instruction cache for simulator performance
-  icache_entry_t icache[ICACHE_ENTRIES];
+  icache_entry_t* icache; // plus one entry past the end that never hits
+  uint8_t* icache_victim; // next way to replace, per set
+  size_t icache_sets;
+  size_t icache_ways;
+  uint64_t icache_hits;
+  uint64_t icache_misses;
+
+  // basic block cache, allocated on first use and flushed with the icache
+  static const reg_t BB_ENTRIES = 4096;
+  bb_entry_t* bb_cache;
+  uint64_t bb_epoch;
+  bool fusion;
 
   // implement a TLB for simulator performance
   static const reg_t TLB_ENTRIES = 256;
@@ -197,11 +333,30 @@ private:
   reg_t tlb_load_tag[TLB_ENTRIES];
   reg_t tlb_store_tag[TLB_ENTRIES];
 
+  // second-level TLB; way w of set s is entry s*ways + w
+  tlb_entry_t* l2_tlb;
+  uint8_t* l2_tlb_victim; // next way to replace, per set
+  size_t l2_tlb_sets;
+  size_t l2_tlb_ways;
+
+  static const reg_t WALK_CACHE_ENTRIES = 64;
+  walk_cache_entry_t walk_cache[WALK_CACHE_ENTRIES];
+
+  reg_t asid;
+  tlb_stats_t tlb_stats;
+
+  // decode the instruction at 'addr' into a victim way of its set
+  icache_entry_t* refill_icache(reg_t addr);
+  bool try_refill_icache(reg_t addr, icache_entry_t** entry, reg_t* cause);
+
   // finish translation on a TLB miss and upate the TLB
   void* refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch);
+  bool try_refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch,
+                      void** host, reg_t* cause);
 
   // perform a page table walk for a given virtual address
   pte_t walk(reg_t addr);
+  pte_t walk_page_table(reg_t addr, reg_t root);
 
 public:
   // translate a virtual address to a physical address
@@ -224,8 +379,73 @@ public:
 
     return refill_tlb(addr, bytes, store, fetch);
   }
+
+  bool try_translate(reg_t addr, reg_t bytes, bool store, bool fetch,
+                     void** host, reg_t* cause) __attribute__((always_inline))
+  {
+    reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
+    reg_t* tags = fetch ? tlb_insn_tag : store ? tlb_store_tag :tlb_load_tag;
+
+    if (unlikely(addr & (bytes-1)))
+    {
+      *cause = store ? CAUSE_MISALIGNED_STORE : fetch ? CAUSE_MISALIGNED_FETCH :
+               CAUSE_MISALIGNED_LOAD;
+      return false;
+    }
+
+    if (likely(tags[idx] == addr >> PGSHIFT))
+    {
+      *host = tlb_data[idx] + addr;
+      return true;
+    }
+
+    return try_refill_tlb(addr, bytes, store, fetch, host, cause);
+  }
   
   friend class processor_t;
+  friend class jit_t;
+};
+
+#ifdef RISCV_MICRO_CHECKER
+// The memory interface seen by instruction handlers (the MMU macro).
+// Handlers instantiated with CHECKER false go through a port that never
+// tests whether to push to the debug buffer.
+template <bool CHECKER>
+class mmu_port_t
+{
+public:
+  mmu_port_t(mmu_t* _mmu) : mmu(_mmu) {}
+
+  #define port_load_func(type) \
+    __attribute__((always_inline)) type##_t load_##type(reg_t addr) { \
+      return mmu->load_##type<CHECKER>(addr); \
+    }
+  #define port_store_func(type) \
+    __attribute__((always_inline)) void store_##type(reg_t addr, type##_t val) { \
+      mmu->store_##type<CHECKER>(addr, val); \
+    }
+
+  port_load_func(uint8)
+  port_load_func(uint16)
+  port_load_func(uint32)
+  port_load_func(uint64)
+  port_load_func(int8)
+  port_load_func(int16)
+  port_load_func(int32)
+  port_load_func(int64)
+  port_store_func(uint8)
+  port_store_func(uint16)
+  port_store_func(uint32)
+  port_store_func(uint64)
+
+  #undef port_load_func
+  #undef port_store_func
+
+  void flush_icache() { mmu->flush_icache(); }
+
+private:
+  mmu_t* mmu;
 };
+#endif
 
 #endif
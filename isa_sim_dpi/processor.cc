@@ -7,6 +7,9 @@
 #include "sim.h"
 #include "htif.h"
 #include "disasm.h"
+#include "trace.h"
+#include "jit.h"
+#include "decode_tree.h"
 #include <cinttypes>
 #include <cmath>
 #include <cstdlib>
@@ -24,7 +27,8 @@ extern bool logging_on;
 
 processor_t::processor_t(sim_t* _sim, mmu_t* _mmu, uint32_t _id)
   : sim(_sim), mmu(_mmu), ext(NULL), disassembler(new disassembler_t),
-    id(_id), run(false), debug(false), serialized(false)
+    id(_id), run(false), debug(false), checker(false), serialized(false), use_jit(false),
+    jit(NULL), decode_cache_stats(false), tlb_stats(false)
 {
   reset(true);
   mmu->set_processor(this);
@@ -32,7 +36,12 @@ processor_t::processor_t(sim_t* _sim, mmu_t* _mmu, uint32_t _id)
   #define DECLARE_INSN(name, match, mask) REGISTER_INSN(this, name, match, mask)
   #include "encoding.h"
   #undef DECLARE_INSN
-  build_opcode_map();
+
+  // The built-in instructions are decoded by decode_tree(), which returns
+  // their position in encoding.h; opcode_map only holds extension ones.
+  builtin_insns.swap(instructions);
+  builtin_insns.push_back((insn_desc_t){0, 0, &illegal_instruction, &illegal_instruction,
+                                        NULL, NULL});
 }
 
 processor_t::~processor_t()
@@ -47,7 +56,21 @@ processor_t::~processor_t()
   }
 #endif
 
+  // Fall-through to the next entry of a run is not a lookup, so the hits
+  // only count lookups made after a branch, a page crossing or a refill.
+  if (decode_cache_stats)
+    fprintf(stderr, "Core %u decode cache: %" PRIu64 " lookup hits, %" PRIu64 " misses\n",
+            id, mmu->icache_hit_count(), mmu->icache_miss_count());
+  if (tlb_stats)
+  {
+    const tlb_stats_t& s = mmu->get_tlb_stats();
+    fprintf(stderr, "Core %u TLB: %" PRIu64 " misses, %" PRIu64 " L2 hits, %" PRIu64
+            " walks, %" PRIu64 " walk cache hits\n",
+            id, s.misses, s.l2_hits, s.walks, s.walk_cache_hits);
+  }
+
   delete disassembler;
+  delete jit;
 }
 
 void state_t::reset()
@@ -119,6 +142,9 @@ bool processor_t::get_debug()
 
 void processor_t::set_checker(bool value)
 {
+  // Decoded handlers depend on the checker mode, see decode_insn().
+  if (value != checker)
+    mmu->flush_icache();
   checker = value;
 }
 
@@ -127,6 +153,30 @@ bool processor_t::get_checker()
   return checker;
 }
 
+void processor_t::set_decode_cache(size_t entries, size_t ways)
+{
+  mmu->configure_icache(entries, ways);
+  decode_cache_stats = true;
+}
+
+void processor_t::set_tlb(size_t entries, size_t ways)
+{
+  mmu->configure_tlb(entries, ways);
+  tlb_stats = true;
+}
+
+void processor_t::set_fusion(bool value)
+{
+  mmu->set_fusion(value);
+}
+
+void processor_t::set_jit(bool value)
+{
+  use_jit = value;
+  if (use_jit && !jit)
+    jit = new jit_t(mmu);
+}
+
 void processor_t::set_proc_type(const char* type)
 {
   proc_type = type;
@@ -300,60 +350,136 @@ void processor_t::step(size_t n,size_t& instret)
           }
         #endif
         fetch = mmu->load_insn(pc);
-        #ifdef RISCV_MICRO_DEBUG
-          if(logging_on){
-		        ifprintf(logging_on,stderr, "Commit Count: %lu ",get_state()->count);
-            disasm(fetch.insn);
-          }
-        #endif
+        TRACE(TE_INSN, id, 1, state.pc, fetch.insn.bits(), get_state()->count);
 
         pc = execute_insn(this, pc, fetch);
 
-        ifprintf(logging_on,stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 " STATUS: %u\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()],STATE.sr);
+        TRACE(TE_INSN_REGS, id, STATE.sr, STATE.XPR[fetch.insn.rs1()], STATE.XPR[fetch.insn.rs2()], STATE.XPR[fetch.insn.rd()]);
+      }
+    }
+    else if (!get_checker() && _mmu->bb_enabled())
+    {
+      // Fast-forward a basic block at a time, following the chain
+      // pointers between blocks instead of looking each one up.
+      // Translated code, if any, runs as much of the block as it can
+      // and the rest is interpreted. Translations and fused pairs are
+      // skipped while logging so that every instruction is still traced.
+      jit_t* _jit = use_jit && !logging_on ? jit : NULL;
+      bool fuse = !logging_on;
+      reg_t* xpr = const_cast<reg_t*>(&state.XPR[0]);
+      bb_entry_t* bb = _mmu->access_bb(pc);
+      while (true)
+      {
+        size_t i = 0;
+        if (_jit && n - instret >= bb->len)
+        {
+          jit_code_t code = _jit->lookup(bb);
+          if (code)
+          {
+            pc = code(xpr, &i);
+            instret += i;
+          }
+        }
+        for (; i < bb->len; i++)
+        {
+          fetch = bb->insns[i];
+          if (bb->fused[i] && fuse && n - instret >= 2)
+          {
+            // A trap from the second instruction is taken at its PC with
+            // the first retired, as if they had run one at a time.
+            reg_t npc;
+            try {
+              npc = bb->fused[i](this, &bb->insns[i], pc);
+            } catch (trap_t& t) {
+              pc += insn_length(fetch.insn.bits());
+              instret++;
+            #ifdef RISCV_MICRO_CHECKER
+              instret++; // the trapping one too, as on the other paths
+            #endif
+              fetch = bb->insns[i+1];
+              throw;
+            }
+            instret += 2;
+            bool sequential = npc == pc + 8;
+            pc = npc;
+            i++;
+            if (instret == n || !sequential)
+              break;
+            continue;
+          }
+          // Counted when the threaded interpreter would count it: before
+          // executing in checker builds, so that a trapping instruction
+          // is counted too, and after executing otherwise.
+        #ifdef RISCV_MICRO_CHECKER
+          instret++;
+        #endif
+          TRACE_INSN(id, 0, pc, fetch.insn.bits(), 0);
+          reg_t npc = execute_insn(this, pc, fetch);
+          TRACE(TE_INSN_REGS, id, STATE.sr, STATE.XPR[fetch.insn.rs1()], STATE.XPR[fetch.insn.rs2()], STATE.XPR[fetch.insn.rd()]);
+        #ifndef RISCV_MICRO_CHECKER
+          instret++;
+        #endif
+          bool sequential = npc == pc + insn_length(fetch.insn.bits());
+          pc = npc;
+          if (instret == n || !sequential)
+            break;
+        }
+        if (instret == n)
+          break;
+
+        bb_entry_t** succ = &bb->succ[pc != bb->end];
+        if (!_mmu->bb_valid(*succ, pc))
+          *succ = _mmu->access_bb(pc);
+        bb = *succ;
       }
     }
-    else while (instret < n)
+    else
     {
-      size_t idx = _mmu->icache_index(pc);
-      auto ic_entry = _mmu->access_icache(pc);
+      // Direct-threaded interpreter over the icache. Every icache slot has
+      // its own dispatch site (icache.h), shared with the slots
+      // ICACHE_SITES apart, so each call through a handler pointer is
+      // predicted per static instruction. A site falls through to the
+      // next slot's site while the PC stays sequential and jumps straight
+      // to the site of the next PC's slot otherwise.
+      static void* const icache_site[] = {
+        #include "icache_labels.h"
+      };
+      icache_entry_t* const icache_base = _mmu->icache;
+      icache_entry_t* ic_entry = _mmu->access_icache(pc);
 
       #ifdef RISCV_MICRO_CHECKER 
-        #define ICACHE_ACCESS(idx) { \
+        #define ICACHE_ACCESS(idx) icache_site_##idx: { \
           instret++; \
           if(get_checker()){ \
             get_pipe()->start(); \
           } \
           fetch = ic_entry->data; \
-          ic_entry++; \
-          if(logging_on){ \
-            disasm(fetch.insn,pc); \
-          } \
+          TRACE_INSN(id, 0, pc, fetch.insn.bits(), 0); \
           pc = execute_insn(this, pc, fetch); \
-          ifprintf(logging_on,stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 " STATUS: %u\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()],STATE.sr); \
-          if (instret == n) break; \
-          if (idx == mmu_t::ICACHE_ENTRIES-1) break; \
-          if (unlikely(ic_entry->tag != pc)) break; \
+          TRACE(TE_INSN_REGS, id, STATE.sr, STATE.XPR[fetch.insn.rs1()], STATE.XPR[fetch.insn.rs2()], STATE.XPR[fetch.insn.rd()]); \
+          ICACHE_NEXT(idx); \
         }
       #else
-        #define ICACHE_ACCESS(idx) { \
+        #define ICACHE_ACCESS(idx) icache_site_##idx: { \
           fetch = ic_entry->data; \
-          ic_entry++; \
-          if(logging_on){ \
-            disasm(fetch.insn,pc); \
-          } \
+          TRACE_INSN(id, 0, pc, fetch.insn.bits(), 0); \
           pc = execute_insn(this, pc, fetch); \
-          ifprintf(logging_on,stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 " STATUS: %u\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()],STATE.sr); \
+          TRACE(TE_INSN_REGS, id, STATE.sr, STATE.XPR[fetch.insn.rs1()], STATE.XPR[fetch.insn.rs2()], STATE.XPR[fetch.insn.rd()]); \
           instret++; \
-          if (instret == n) break; \
-          if (idx == mmu_t::ICACHE_ENTRIES-1) break; \
-          if (unlikely(ic_entry->tag != pc)) break; \
+          ICACHE_NEXT(idx); \
         }
       #endif
+      #define ICACHE_NEXT(idx) \
+          if (unlikely(instret == n)) goto icache_done; \
+          if (idx == mmu_t::ICACHE_SITES-1 || unlikely(ic_entry[1].tag != pc)) { \
+            ic_entry = _mmu->access_icache(pc); \
+            goto *icache_site[(ic_entry - icache_base) % mmu_t::ICACHE_SITES]; \
+          } \
+          ic_entry++;
 
-      switch (idx) {
-        #include "icache.h"
-      }
-      ifprintf(logging_on,stderr,"Breaking out of ICACHE construct INSTRET = %lu\n",instret);
+      goto *icache_site[(ic_entry - icache_base) % mmu_t::ICACHE_SITES];
+      #include "icache.h"
+      icache_done: ;
     }
   }
   catch(trap_t& t)
@@ -395,8 +521,7 @@ reg_t processor_t::take_trap(trap_t& t, reg_t epc)
 {
   //TODO: Add this back
   //if (debug)
-    ifprintf(logging_on,stderr, "core %3d: exception %s, epc 0x%016" PRIx64 "\n",
-            id, t.name(), epc);
+    TRACE(TE_EXCEPTION, id, 0, epc, t.cause(), 0);
 
   // switch to supervisor, set previous supervisor bit, disable interrupts
   set_pcr(CSR_STATUS, (((state.sr & ~SR_EI) | SR_S) & ~SR_PS & ~SR_PEI) |
@@ -438,7 +563,7 @@ void processor_t::set_pipe(debug_buffer_t* _pipe)
 
 void processor_t::set_pcr(int which, reg_t val)
 {
-  ifprintf(logging_on,stderr,"Set PCR 0x%x -> 0x%lx\n",which,val);
+  TRACE(TE_SET_PCR, id, which, val, 0, 0);
   switch (which)
   {
     case CSR_FFLAGS:
@@ -463,7 +588,7 @@ void processor_t::set_pcr(int which, reg_t val)
         state.sr &= ~SR_EA;
       state.sr &= ~SR_ZERO;
       rv64 = (state.sr & SR_S) ? (state.sr & SR_S64) : (state.sr & SR_U64);
-      mmu->flush_tlb();
+      mmu->flush_tlb_untagged();
       break;
     case CSR_EPC:
       state.epc = val;
@@ -485,6 +610,9 @@ void processor_t::set_pcr(int which, reg_t val)
     case CSR_PTBR:
       state.ptbr = val & ~(PGSIZE-1);
       break;
+    case CSR_ASID:
+      mmu->set_asid(val);
+      break;
     case CSR_SEND_IPI:
       sim->send_ipi(val);
       break;
@@ -559,7 +687,7 @@ reg_t processor_t::get_pcr(int which)
     case CSR_CLEAR_IPI:
       return 0;
     case CSR_ASID:
-      return 0;
+      return mmu->get_asid();
     case CSR_FATC:
       mmu->flush_tlb();
       return 0;
@@ -608,19 +736,28 @@ void processor_t::set_interrupt(int which, bool on)
     state.sr &= ~mask;
 }
 
-reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc)
+reg_t illegal_instruction(processor_t* p, decoded_insn_t insn, reg_t pc)
 {
   throw trap_illegal_instruction();
 }
 
 insn_func_t processor_t::decode_insn(insn_t insn)
 {
-  size_t mask = opcode_map.size()-1;
-  insn_desc_t* desc = opcode_map[insn.bits() & mask]; 
+  size_t idx = decode_tree(insn.bits());
+  insn_desc_t* desc = &builtin_insns[idx];
 
-  while ((insn.bits() & desc->mask) != desc->match)
-    desc++;
+  if (unlikely(idx == DECODE_TREE_INSNS && ext != NULL))
+  {
+    size_t mask = opcode_map.size()-1;
+    desc = opcode_map[insn.bits() & mask];
+
+    while ((insn.bits() & desc->mask) != desc->match)
+      desc++;
+  }
 
+  insn_func_t fast = rv64 ? desc->rv64_fast : desc->rv32_fast;
+  if (!checker && fast)
+    return fast;
   return rv64 ? desc->rv64 : desc->rv32;
 }
 
@@ -664,6 +801,8 @@ void processor_t::build_opcode_map()
   opcode_store[j].match = opcode_store[j].mask = 0;
   opcode_store[j].rv32 = &illegal_instruction;
   opcode_store[j].rv64 = &illegal_instruction;
+  opcode_store[j].rv32_fast = NULL;
+  opcode_store[j].rv64_fast = NULL;
 }
 
 void processor_t::register_extension(extension_t* x)
@@ -11,12 +11,13 @@
 
 class processor_t;
 class mmu_t;
-typedef reg_t (*insn_func_t)(processor_t*, insn_t, reg_t);
+typedef reg_t (*insn_func_t)(processor_t*, decoded_insn_t, reg_t);
 class sim_t;
 class trap_t;
 class extension_t;
 class disassembler_t;
 class debug_buffer_t;
+class jit_t;
 
 struct serialize_t {};
 
@@ -26,6 +27,8 @@ struct insn_desc_t
   uint32_t mask;
   insn_func_t rv32;
   insn_func_t rv64;
+  insn_func_t rv32_fast; // used with the checker off; NULL to use rv32/rv64
+  insn_func_t rv64_fast;
 };
 
 struct commit_log_reg_t
@@ -79,6 +82,10 @@ public:
   bool get_debug();
   void set_checker(bool value);
   bool get_checker();
+  void set_jit(bool value); // translate hot blocks while the checker is off
+  void set_fusion(bool value); // fuse instruction pairs while the checker is off
+  void set_decode_cache(size_t entries, size_t ways); // also reports hits/misses
+  void set_tlb(size_t entries, size_t ways); // second-level TLB; also reports misses
   void set_proc_type(const char*);
   const char* get_proc_type();
   void set_histogram(bool value);
@@ -93,6 +100,7 @@ public:
   mmu_t* get_mmu() { return mmu; }
   state_t* get_state() { return &state; }
   extension_t* get_extension() { return ext; }
+  disassembler_t* get_disassembler() { return disassembler; }
   void yield_load_reservation() { state.load_reservation = (reg_t)-1; }
   virtual void update_histogram(size_t pc);
 
@@ -119,6 +127,10 @@ protected:
   bool histogram_enabled;
   bool rv64;
   bool serialized;
+  bool use_jit;
+  jit_t* jit; // created on first use
+  bool decode_cache_stats;
+  bool tlb_stats;
 
   debug_buffer_t* pipe;
 
@@ -139,17 +151,21 @@ protected:
 private:
   void build_opcode_map();
   insn_func_t decode_insn(insn_t insn);
-  std::vector<insn_desc_t> instructions;
+  std::vector<insn_desc_t> builtin_insns; // in encoding.h order, then illegal
+  std::vector<insn_desc_t> instructions; // extension instructions
   std::vector<insn_desc_t*> opcode_map;
   std::vector<insn_desc_t> opcode_store;
 
 };
 
-reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc);
+reg_t illegal_instruction(processor_t* p, decoded_insn_t insn, reg_t pc);
 
 #define REGISTER_INSN(proc, name, match, mask) \
-  extern reg_t rv32_##name(processor_t*, insn_t, reg_t); \
-  extern reg_t rv64_##name(processor_t*, insn_t, reg_t); \
-  proc->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name});
+  extern reg_t rv32_##name(processor_t*, decoded_insn_t, reg_t); \
+  extern reg_t rv64_##name(processor_t*, decoded_insn_t, reg_t); \
+  extern reg_t rv32_##name##_fast(processor_t*, decoded_insn_t, reg_t); \
+  extern reg_t rv64_##name##_fast(processor_t*, decoded_insn_t, reg_t); \
+  proc->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name, \
+                                    rv32_##name##_fast, rv64_##name##_fast});
 
 #endif
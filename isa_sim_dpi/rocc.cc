@@ -4,8 +4,9 @@
 #include "debug.h"
 
 #define customX(n) \
-  static reg_t c##n(processor_t* p, insn_t insn, reg_t pc) \
+  static reg_t c##n(processor_t* p, decoded_insn_t insn, reg_t pc) \
   { \
+    const bool CHECKER = true; /* one handler for both checker modes */ \
     require_accelerator; \
     rocc_t* rocc = static_cast<rocc_t*>(p->get_extension()); \
     rocc_insn_union_t u; \
@@ -0,0 +1,69 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_SPSC_QUEUE_H
+#define _RISCV_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free queue with exactly one producer thread and one
+// consumer thread. The producer only writes 'tail' and the consumer only
+// writes 'head'; each side reads the other's index with acquire ordering,
+// so an element is fully written before it becomes visible.
+template <class T>
+class spsc_queue_t
+{
+public:
+  spsc_queue_t(size_t size) : buf(size), mask(size - 1), head(0), tail(0)
+  {
+    assert(size && (size & (size - 1)) == 0);
+  }
+
+  bool empty()
+  {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  bool full()
+  {
+    return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == buf.size();
+  }
+
+  // Producer side. Returns false if the queue is full.
+  bool push(const T& item)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == buf.size())
+      return false;
+    buf[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns a pointer to the oldest element, or NULL if the
+  // queue is empty. The element stays valid until pop() is called.
+  T* front()
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+      return NULL;
+    return &buf[h & mask];
+  }
+
+  void pop()
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    assert(h != tail.load(std::memory_order_acquire));
+    head.store(h + 1, std::memory_order_release);
+  }
+
+private:
+  std::vector<T> buf;
+  size_t mask;
+  std::atomic<size_t> head; // next element to consume
+  std::atomic<size_t> tail; // next free slot
+};
+
+#endif
@@ -0,0 +1,258 @@
+// See LICENSE for license details.
+
+#include "trace.h"
+#include "spsc_queue.h"
+#include "gzstream.h"
+#include "disasm.h"
+#include "encoding.h"
+#include "trap.h"
+#include <cinttypes>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Records per thread. A full ring stalls its thread until the writer
+// catches up, so no event is ever dropped.
+static const size_t TRACE_RING_SIZE = 1 << 16;
+
+typedef spsc_queue_t<trace_rec_t> trace_ring_t;
+
+static std::atomic<bool>          trace_binary(false);
+static std::atomic<bool>          writer_run(false);
+static std::thread                writer;
+static ogzstream                  trace_file;
+static std::mutex                 rings_lock;   // guards 'rings'
+static std::vector<trace_ring_t*> rings;
+
+static thread_local trace_ring_t* my_ring = NULL;
+static thread_local uint16_t      my_thread = 0;
+
+// Write out everything currently in the rings. Returns the number of
+// records written.
+static size_t drain_rings()
+{
+  std::lock_guard<std::mutex> lock(rings_lock);
+  size_t n = 0;
+  for (size_t i = 0; i < rings.size(); i++)
+  {
+    trace_rec_t* rec;
+    while ((rec = rings[i]->front()) != NULL)
+    {
+      trace_file.write((const char*)rec, sizeof(trace_rec_t));
+      rings[i]->pop();
+      n++;
+    }
+  }
+  return n;
+}
+
+static void writer_loop()
+{
+  while (true)
+  {
+    bool run = writer_run.load(std::memory_order_acquire);
+    if (drain_rings() == 0)
+    {
+      if (!run)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+bool trace_open(const char* path)
+{
+  trace_file.open(path);
+  if (!trace_file.good())
+  {
+    fprintf(stderr, "Unable to open trace file %s\n", path);
+    return false;
+  }
+  uint32_t rec_size = sizeof(trace_rec_t);
+  trace_file.write(TRACE_MAGIC, 8);
+  trace_file.write((const char*)&rec_size, sizeof(rec_size));
+
+  writer_run = true;
+  writer = std::thread(writer_loop);
+  trace_binary = true;
+  atexit(trace_close);
+  return true;
+}
+
+void trace_close()
+{
+  if (!writer.joinable())
+    return;
+  trace_binary = false;
+  writer_run = false;
+  writer.join();
+  trace_file.close();
+}
+
+void trace_event(uint8_t event, uint8_t core, uint32_t aux, uint64_t a, uint64_t b, uint64_t c)
+{
+  trace_rec_t rec;
+  rec.event = event;
+  rec.core = core;
+  rec.thread = 0;
+  rec.aux = aux;
+  rec.a = a;
+  rec.b = b;
+  rec.c = c;
+
+  if (!trace_binary.load(std::memory_order_relaxed))
+  {
+    trace_print(stderr, rec);
+    return;
+  }
+
+  if (unlikely(!my_ring))
+  {
+    std::lock_guard<std::mutex> lock(rings_lock);
+    if (rings.size() > UINT16_MAX)
+    {
+      fprintf(stderr, "Too many threads for the trace file\n");
+      abort();
+    }
+    my_thread = rings.size();
+    my_ring = new trace_ring_t(TRACE_RING_SIZE);
+    rings.push_back(my_ring);
+  }
+  rec.thread = my_thread;
+  while (!my_ring->push(rec))
+    std::this_thread::yield();
+}
+
+static const char* trap_name(reg_t cause)
+{
+  static char name[16];
+  switch (cause)
+  {
+    case CAUSE_MISALIGNED_FETCH: return "trap_instruction_address_misaligned";
+    case CAUSE_FAULT_FETCH: return "trap_instruction_access_fault";
+    case CAUSE_ILLEGAL_INSTRUCTION: return "trap_illegal_instruction";
+    case CAUSE_PRIVILEGED_INSTRUCTION: return "trap_privileged_instruction";
+    case CAUSE_FP_DISABLED: return "trap_fp_disabled";
+    case CAUSE_SYSCALL: return "trap_syscall";
+    case CAUSE_BREAKPOINT: return "trap_breakpoint";
+    case CAUSE_MISALIGNED_LOAD: return "trap_load_address_misaligned";
+    case CAUSE_MISALIGNED_STORE: return "trap_store_address_misaligned";
+    case CAUSE_FAULT_LOAD: return "trap_load_access_fault";
+    case CAUSE_FAULT_STORE: return "trap_store_access_fault";
+    case CAUSE_ACCELERATOR_DISABLED: return "trap_accelerator_disabled";
+    case CAUSE_CSR_INSTRUCTION: return "trap_csr_instruction";
+  }
+  // Same text as trap_t::name().
+  const char* fmt = uint8_t(cause) == cause ? "trap #%u" : "interrupt #%u";
+  sprintf(name, fmt, uint8_t(cause));
+  return name;
+}
+
+void trace_print(FILE* file, const trace_rec_t& r)
+{
+  static disassembler_t disassembler;
+
+  switch (r.event)
+  {
+    case TE_INSN:
+    {
+      insn_t insn(r.b);
+      uint64_t bits = insn.bits() & ((1ULL << (8 * insn_length(insn.bits()))) - 1);
+      if (r.aux)
+        fprintf(file, "Commit Count: %" PRIu64 " ", r.c);
+      fprintf(file, "core %3d: 0x%016" PRIx64 " (0x%08" PRIx64 ") %s\n",
+              r.core, r.a, bits, disassembler.disassemble(insn).c_str());
+      break;
+    }
+    case TE_INSN_REGS:
+      fprintf(file, "RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 " STATUS: %u\n", r.a, r.b, r.c, r.aux);
+      break;
+    case TE_EXCEPTION:
+      fprintf(file, "core %3d: exception %s, epc 0x%016" PRIx64 "\n", r.core, trap_name(r.b), r.a);
+      break;
+    case TE_SET_PCR:
+      fprintf(file, "Set PCR 0x%x -> 0x%" PRIx64 "\n", r.aux, r.a);
+      break;
+    case TE_PTE_PERM:
+      fprintf(file, "PTE Perm 0x%" PRIxreg "  Perm 0x%" PRIxreg "\n", r.a, r.b);
+      break;
+    case TE_DB_START:
+      fprintf(file, "Starting debug buffer entry %u\n", r.aux);
+      break;
+    case TE_DB_PUSH_OPERAND:
+      fprintf(file, "Pushing operand type: %u to entry %u\n", (unsigned)r.a, r.aux);
+      break;
+    case TE_DB_PUSH_ADDR:
+      fprintf(file, "Pushing operand type: %u to entry %u addr %" PRIu64 "\n", (unsigned)r.a, r.aux, r.b);
+      break;
+    case TE_DB_POP:
+      fprintf(file, "Timing simulator popping entry %u\n", r.aux);
+      break;
+    case TE_ARCH_REG:
+      fprintf(file, "Architecture Reg Value: %u -> 0x%" PRIX64 "\n", r.aux, r.a);
+      break;
+    case TE_ARCH_PC:
+      fprintf(file, "Architecture PC is: 0x%" PRIX64 "\n", r.a);
+      break;
+    case TE_FETCH_EXCEPTION:
+      fprintf(file, "Instruction Fetch Exception vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.b);
+      break;
+    case TE_LOAD:
+      fprintf(file, "Load addr is: 0x%" PRIX64 "\n", r.a);
+      break;
+    case TE_LOAD_CYCLE:
+      fprintf(file, "Cycle: %" PRId64 " Load addr is: 0x%" PRIX64 " data is: 0x%" PRIX64 " Exception: %d\n",
+              r.a, r.b, r.c, (int)r.aux);
+      break;
+    case TE_LOAD_EXCEPTION:
+      fprintf(file, "Load Exception vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.b);
+      break;
+    case TE_LOAD_LANE:
+      fprintf(file, "Cycle: %" PRId64 " Load lane: %d addr is: 0x%" PRIX64 " size: %d data is: 0x%" PRIX64 " Exception: %d\n",
+              r.a, r.aux & 0xff, r.b, (r.aux >> 8) & 0xff, r.c, r.aux >> 16);
+      break;
+    case TE_LOAD_LANE_EXCEPTION:
+      fprintf(file, "Cycle: %" PRId64 " Load Exception lane: %d vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.aux, r.b, r.c);
+      break;
+    case TE_STORE:
+      fprintf(file, "Store addr is: 0x%" PRIX64 " and store data is: 0x%" PRIX64 "\n", r.a, r.b);
+      break;
+    case TE_STORE_CYCLE:
+      fprintf(file, "Cycle %" PRId64 ": Store addr is: 0x%" PRIX64 " and store data is: 0x%" PRIX64 "\n", r.a, r.b, r.c);
+      break;
+    case TE_STORE_EXCEPTION:
+      fprintf(file, "Store Exception vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.b);
+      break;
+    case TE_STORE_EXCEPTION_CYCLE:
+      fprintf(file, "Cycle %" PRId64 ": Store Exception vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.b, r.c);
+      break;
+    case TE_STORE_LANE:
+      fprintf(file, "Cycle %" PRId64 ": Store lane: %d addr is: 0x%" PRIX64 " size: %d data is: 0x%" PRIX64 "\n",
+              r.a, r.aux & 0xff, r.b, (r.aux >> 8) & 0xff, r.c);
+      break;
+    case TE_STORE_LANE_EXCEPTION:
+      fprintf(file, "Cycle %" PRId64 ": Store Exception lane: %d vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.aux, r.b, r.c);
+      break;
+    case TE_TRANSLATE:
+      fprintf(file, "Translate vaddr: 0x%" PRIX64 " bytes: %d\n", r.a, r.aux);
+      break;
+    case TE_TRANSLATE_EXCEPTION:
+      fprintf(file, "Memory Access Exception vaddr: 0x%" PRIX64 " cause: %" PRIu64 "\n", r.a, r.b);
+      break;
+    case TE_CHECK:
+      fprintf(file, "Cycle %" PRId64 ": Commit: %" PRId64 " Checking instruction for PC 0x%" PRIx64 "\n", r.a, r.b, r.c);
+      break;
+    case TE_WRITE_CSR:
+      fprintf(file, "Write CSR 0x%x ->  0x%" PRIX64 "\n", r.aux, r.a);
+      break;
+    case TE_READ_CSR:
+      fprintf(file, "Read CSR 0x%x\n", r.aux);
+      break;
+    default:
+      fprintf(file, "Unknown trace event %u\n", r.event);
+      break;
+  }
+}
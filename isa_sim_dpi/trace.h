@@ -0,0 +1,95 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_TRACE_H
+#define _RISCV_TRACE_H
+
+#include <cstdio>
+#include <cstdint>
+#include "common.h"
+
+// Structured event trace.
+//
+// Hot paths record fixed-size binary events instead of formatting text.
+// When a trace file has been opened with trace_open(), every thread
+// appends its events to its own lock-free ring and a background writer
+// thread drains the rings into a gzip-compressed file. trace_decode
+// renders such a file in the same text format as the live log. Without a
+// trace file, events are formatted to stderr right away, as before.
+
+enum trace_event_t
+{
+  TE_INSN,                    // core, a=pc b=insn bits c=commit count, aux=1 if count is printed
+  TE_INSN_REGS,               // a=rs1 b=rs2 c=rd values, aux=status
+  TE_EXCEPTION,               // core, a=epc b=cause
+  TE_SET_PCR,                 // aux=csr a=value
+  TE_PTE_PERM,                // a=pte perm b=required perm
+  TE_DB_START,                // aux=debug buffer entry
+  TE_DB_PUSH_OPERAND,         // aux=debug buffer entry a=operand type
+  TE_DB_PUSH_ADDR,            // aux=debug buffer entry a=operand type b=addr
+  TE_DB_POP,                  // aux=debug buffer entry
+  TE_ARCH_REG,                // aux=reg a=value
+  TE_ARCH_PC,                 // a=pc
+  TE_FETCH_EXCEPTION,         // a=vaddr b=cause
+  TE_LOAD,                    // a=addr
+  TE_LOAD_CYCLE,              // a=cycle b=addr c=data aux=exception
+  TE_LOAD_EXCEPTION,          // a=vaddr b=cause
+  TE_LOAD_LANE,               // a=cycle b=addr c=data aux=lane|size<<8|exception<<16
+  TE_LOAD_LANE_EXCEPTION,     // a=cycle b=addr c=cause aux=lane
+  TE_STORE,                   // a=addr b=data
+  TE_STORE_CYCLE,             // a=cycle b=addr c=data
+  TE_STORE_EXCEPTION,         // a=vaddr b=cause
+  TE_STORE_EXCEPTION_CYCLE,   // a=cycle b=vaddr c=cause
+  TE_STORE_LANE,              // a=cycle b=addr c=data aux=lane|size<<8
+  TE_STORE_LANE_EXCEPTION,    // a=cycle b=addr c=cause aux=lane
+  TE_TRANSLATE,               // a=vaddr aux=bytes
+  TE_TRANSLATE_EXCEPTION,     // a=vaddr b=cause
+  TE_CHECK,                   // a=cycle b=commit c=pc
+  TE_WRITE_CSR,               // aux=csr a=value
+  TE_READ_CSR,                // aux=csr
+  TE_NUM_EVENTS
+};
+
+struct trace_rec_t
+{
+  uint8_t  event;
+  uint8_t  core;
+  uint16_t thread;    // index of the emitting thread, in registration order
+  uint32_t aux;
+  uint64_t a;
+  uint64_t b;
+  uint64_t c;
+};
+
+#define TRACE_MAGIC "RVTRACE2"
+
+// Start writing binary events to 'path'. Returns false if the file
+// cannot be opened.
+bool trace_open(const char* path);
+// Drain all rings, stop the writer thread and close the file.
+void trace_close();
+
+void trace_event(uint8_t event, uint8_t core, uint32_t aux, uint64_t a, uint64_t b, uint64_t c);
+
+// Render one event in the text format of the live log.
+void trace_print(FILE* file, const trace_rec_t& rec);
+
+// TRACE_INSN is for the per-instruction disassembly, which is logged
+// whenever logging is on. Everything else goes through TRACE, which only
+// exists with RISCV_MICRO_DEBUG, like ifprintf.
+#define TRACE_INSN(core, aux, pc, bits, count){ \
+    if(logging_on){ \
+      trace_event(TE_INSN, core, aux, pc, bits, count); \
+    } \
+  }
+
+#ifdef RISCV_MICRO_DEBUG
+  #define TRACE(event, core, aux, a, b, c){ \
+      if(logging_on){ \
+        trace_event(event, core, aux, a, b, c); \
+      } \
+    }
+#else
+  #define TRACE(event, core, aux, a, b, c){ }
+#endif
+
+#endif
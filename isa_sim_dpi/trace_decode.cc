@@ -0,0 +1,58 @@
+// See LICENSE for license details.
+
+// Render a binary trace written with --trace=<file> as text, in the same
+// format the simulators print to stderr with logging on. Records are
+// printed in file order; with -t each line is prefixed by the index of
+// the thread that emitted it, since records from different threads are
+// only ordered within each thread.
+
+#include "trace.h"
+#include "gzstream.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+static void help()
+{
+  fprintf(stderr, "usage: trace_decode [-t] <trace file>\n");
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  bool show_thread = false;
+  const char* path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-t"))
+      show_thread = true;
+    else if (!path)
+      path = argv[i];
+    else
+      help();
+  }
+  if (!path)
+    help();
+
+  igzstream in(path);
+  char magic[8];
+  uint32_t rec_size = 0;
+  in.read(magic, sizeof(magic));
+  in.read((char*)&rec_size, sizeof(rec_size));
+  if (!in.good() || memcmp(magic, TRACE_MAGIC, sizeof(magic)) || rec_size != sizeof(trace_rec_t))
+  {
+    fprintf(stderr, "%s is not a trace file\n", path);
+    return 1;
+  }
+
+  trace_rec_t rec;
+  while (in.read((char*)&rec, sizeof(rec)))
+  {
+    if (show_thread)
+      fprintf(stdout, "[%u] ", rec.thread);
+    trace_print(stdout, rec);
+  }
+  return 0;
+}
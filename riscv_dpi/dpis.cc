@@ -1,5 +1,6 @@
 // See LICENSE for license details.
 
+#include "svdpi.h"
 #include "sim.h"
 #include "htif.h"
 #include "cachesim.h"
@@ -15,6 +16,7 @@
 #include <algorithm>
 #include "debug.h"
 #include "parameters.h"
+#include "trace.h"
 #include <signal.h>
 
 static void help()
@@ -50,6 +52,14 @@ static void help()
   fprintf(stderr, "  --l2=<S>:<W>:<B>   B both powers of 2).\n");
   fprintf(stderr, "  --extension=<name> Specify RoCC Extension\n");
   fprintf(stderr, "  --extlib=<name>    Shared library to load\n");
+  fprintf(stderr, "  --trace=<file>     Write the log as a binary trace to <file> (read it with trace_decode)\n");
+  fprintf(stderr, "  --jit              Translate hot code to host code while fast skipping\n");
+  fprintf(stderr, "  --fuse             Fuse common instruction pairs while fast skipping\n");
+  fprintf(stderr, "  --decode-cache=<E>:<W> Cache decoded instructions in E entries, W ways each (powers of 2)\n");
+  fprintf(stderr, "  --tlb=<E>:<W>      Back the TLB with an E-entry, W-way second level (powers of 2)\n");
+  fprintf(stderr, "  --chkpt-store=<dir> Keep checkpoint memory pages in the shared page store <dir>\n");
+  fprintf(stderr, "  --chkpt-raw        Also write uncompressed <file>.memory and <file>.proc (for --lazy-restore)\n");
+  fprintf(stderr, "  --chkpt-at=<n>[,<n>...] Write checkpoint.<n> after <n> fast skipped instructions, all in one pass\n");
   exit(1);
 }
 
@@ -60,6 +70,10 @@ extern "C" void set_csr_in_rtl(int, uint64_t){};
 extern "C" uint64_t get_csr_from_rtl(int){return 0;};
 extern "C" void end_rtl_simulation(){};
 extern "C" void flush_caches_in_rtl(){};
+// Open-array accessors are provided by the RTL simulator.
+extern "C" int svLow(const svOpenArrayHandle, int){return 0;};
+extern "C" int svLength(const svOpenArrayHandle, int){return 0;};
+extern "C" void* svGetArrElemPtr1(const svOpenArrayHandle, int){return NULL;};
 
 static void sim_stats(FILE* stream)
 {
@@ -148,6 +162,12 @@ int main(int argc, char** argv)
 {
   bool debug = false;
   bool histogram = false;
+  bool jit = false;
+  bool fuse = false;
+  size_t decode_cache_entries = 0; // 0 keeps the default decode cache
+  size_t decode_cache_ways = 0;
+  size_t tlb_entries = 0; // 0 keeps the default TLB
+  size_t tlb_ways = 0;
   size_t nprocs = 1;
   size_t mem_mb = 0;
   size_t skip_amt = 0;
@@ -159,6 +179,9 @@ int main(int argc, char** argv)
 
   bool restore_checkpoint = false;
   std::string checkpoint_file = "checkpoint";
+  const char* chkpt_store = NULL;
+  bool chkpt_raw = false;
+  std::vector<size_t> chkpt_points;
 
   option_parser_t parser;
   parser.help(&help);
@@ -198,10 +221,49 @@ int main(int argc, char** argv)
   parser.option(0, "phase",1, [&](const char *s){phase_interval = atoll(s);});
   parser.option(0, "lane" ,1, [&](const char *s){set_lane_matrix(s);});
   parser.option(0, "nol2", 1, [&](const char* s){L2_PRESENT = false;});
+  parser.option(0, "trace", 1, [&](const char* s){
+    if (!trace_open(s))
+      exit(-1);
+  });
+  parser.option(0, "jit", 0, [&](const char* s){jit = true;});
+  parser.option(0, "fuse", 0, [&](const char* s){fuse = true;});
+  parser.option(0, "chkpt-store", 1, [&](const char* s){chkpt_store = s;});
+  parser.option(0, "chkpt-raw", 0, [&](const char* s){chkpt_raw = true;});
+  parser.option(0, "chkpt-at", 1, [&](const char* s){
+    char* end;
+    do {
+      chkpt_points.push_back(strtoull(s, &end, 0));
+      if (end == s || (*end && *end != ',')) help();
+      s = end + 1;
+    } while (*end);
+  });
+  parser.option(0, "decode-cache", 1, [&](const char* s){
+    const char* wp = strchr(s, ':');
+    if (!wp++) help();
+    decode_cache_entries = atoi(std::string(s, wp).c_str());
+    decode_cache_ways = atoi(wp);
+    if (!mmu_t::valid_geometry(decode_cache_entries, decode_cache_ways, mmu_t::ICACHE_MAX_WAYS))
+      help();
+  });
+  parser.option(0, "tlb", 1, [&](const char* s){
+    const char* wp = strchr(s, ':');
+    if (!wp++) help();
+    tlb_entries = atoi(std::string(s, wp).c_str());
+    tlb_ways = atoi(wp);
+    if (!mmu_t::valid_geometry(tlb_entries, tlb_ways, mmu_t::TLB_MAX_WAYS))
+      help();
+  });
 
   auto argv1 = parser.parse(argv);
   if (!*argv1)
     help();
+
+  // Checkpoints are written during the fast skip, which has to reach the
+  // last of them.
+  if (!chkpt_points.empty()) {
+    skip_amt = std::max(skip_amt, *std::max_element(chkpt_points.begin(), chkpt_points.end()));
+    skip_enable = true;
+  }
   std::vector<std::string> htif_args(argv1, (const char*const*)argv + argc);
   s_micro = new sim_t(nprocs, mem_mb, htif_args, DPI_SIM);
 
@@ -216,9 +278,27 @@ int main(int argc, char** argv)
 
   s_micro->set_debug(debug);
   s_micro->set_histogram(histogram);
+  s_micro->set_jit(jit);
+  s_micro->set_fusion(fuse);
+  if (chkpt_store)
+    s_micro->set_checkpoint_store(chkpt_store);
+  s_micro->set_checkpoint_raw(chkpt_raw);
+  if (decode_cache_entries)
+    s_micro->set_decode_cache(decode_cache_entries, decode_cache_ways);
+  if (tlb_entries)
+    s_micro->set_tlb(tlb_entries, tlb_ways);
 
   #ifdef RISCV_MICRO_CHECKER
     s_isa = new sim_t(nprocs, mem_mb, htif_args, ISA_SIM);
+    s_isa->set_jit(jit);
+    s_isa->set_fusion(fuse);
+    if (chkpt_store)
+      s_isa->set_checkpoint_store(chkpt_store);
+    s_isa->set_checkpoint_raw(chkpt_raw);
+    if (decode_cache_entries)
+      s_isa->set_decode_cache(decode_cache_entries, decode_cache_ways);
+    if (tlb_entries)
+      s_isa->set_tlb(tlb_entries, tlb_ways);
     Pipe = new debug_buffer_t(PIPE_QUEUE_SIZE);
 
     Pipe->set_isa_sim(s_isa);
@@ -360,6 +440,8 @@ int main(int argc, char** argv)
 
   // Runs Micors
   if(skip_enable & (!restore_checkpoint)){
+    if (!chkpt_points.empty())
+      s_micro->init_checkpoint(checkpoint_file, chkpt_points);
     fprintf(stderr, "Fast skipping MICROS for %lu instructions\n",skip_amt);
     htif_code = s_micro->run_fast(skip_amt);
     // Stop simulation if HTIF returns non-zero code
@@ -1,10 +1,9 @@
-//#include "svdpi.h"
-
-
+#include "svdpi.h"
 #include "sim.h"
 #include "htif.h"
 #include "cachesim.h"
 #include "extension.h"
+#include "disasm.h"
 #include <dlfcn.h>
 #include <fesvr/option_parser.h>
 #include <stdio.h>
@@ -13,8 +12,15 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
 #include "debug.h"
 #include "dpisim.h"
+#include "spsc_queue.h"
+#include "trace.h"
+#include <atomic>
+#include <thread>
 
 static void help()
 {
@@ -33,6 +39,16 @@ static void help()
   fprintf(stderr, "  --l2=<S>:<W>:<B>     B both powers of 2).\n");
   fprintf(stderr, "  --extension=<name> Specify RoCC Extension\n");
   fprintf(stderr, "  --extlib=<name>    Shared library to load\n");
+  fprintf(stderr, "  --sync-checker     Step the checker's ISA simulator in the caller instead of on its own thread\n");
+  fprintf(stderr, "  --deferred-check=<n> Compare commits on a separate thread, queueing up to <n> per hart\n");
+  fprintf(stderr, "  --trace=<file>     Write the log as a binary trace to <file> (read it with trace_decode)\n");
+  fprintf(stderr, "  --jit              Translate hot code to host code while fast skipping\n");
+  fprintf(stderr, "  --fuse             Fuse common instruction pairs while fast skipping\n");
+  fprintf(stderr, "  --decode-cache=<E>:<W> Cache decoded instructions in E entries, W ways each (powers of 2)\n");
+  fprintf(stderr, "  --tlb=<E>:<W>      Back the TLB with an E-entry, W-way second level (powers of 2)\n");
+  fprintf(stderr, "  --lazy-restore     With -c, read checkpointed memory pages from <file>.memory on first touch\n");
+  fprintf(stderr, "                     (write the checkpoint with --chkpt-raw to get <file>.memory)\n");
+  fprintf(stderr, "  --chkpt-store=<dir> Keep checkpoint memory pages in the shared page store <dir>\n");
   exit(1);
 }
 
@@ -43,20 +59,109 @@ time_t start_time;
 extern void read_config_from_file(int& nargs, char*** args, FILE** fp_job);
 
 // Should be global variables for access from all DPI functions
-static debug_buffer_t* Pipe;
 //debug_buffer_t pipe(128);
 static sim_t*  s_isa;
 static sim_t*  s_dpi;
-static long long arch_pc; // Keeps track of the architectural PC of the functional simulator
+
+// Per-hart state, indexed by hart id. The DPI SIM cores and their MMUs are
+// cached at initialization so that the entry points do not go through
+// sim_t::get_core() on every call.
+static std::vector<dpisim_t*>       hart_sim;
+static std::vector<mmu_t*>          hart_mmu;
+static std::vector<debug_buffer_t*> hart_pipe;    // debug buffer fed by the matching ISA sim core
+static std::vector<long long>       hart_arch_pc; // Keeps track of the architectural PC of the functional simulator
 static int numMismatches = 0;
 static bool debug = false;
 static bool histogram = false;
+static bool jit = false;
+static bool fuse = false;
+static size_t decode_cache_entries = 0; // 0 keeps the default decode cache
+static size_t decode_cache_ways = 0;
+static size_t tlb_entries = 0; // 0 keeps the default TLB
+static size_t tlb_ways = 0;
 static size_t nprocs = 1;
 static size_t mem_mb = 0;
 static size_t skip_amt = 0;
 static bool skip_enable = false; //Changes: Mohit (Initialize to skip false)
 static bool restore_checkpoint = false; //Changes: Mohit (Initialize to false)
 static std::string checkpoint_file = "checkpoint"; //Changes: Mohit (Initialize)
+static bool lazy_restore = false;
+static const char* chkpt_store = NULL;
+static bool sync_checker = false;
+static const char* trace_file = NULL;
+
+// Deferred checking. The RTL thread only snapshots each commit into a per-hart
+// queue; a worker thread compares the commits against the debug buffers and
+// publishes the outcome through 'mismatch_seen' and 'first_mismatch'.
+struct commit_record_t
+{
+  long long cycle;
+  long long commit;
+  long long pc;
+  long long dest_value;
+  int       dest;
+  cycle_t   sim_cycle;  // DPI SIM cycle and instruction counts at this commit
+  uint64_t  sim_insn;
+  state_t   state;      // DPI SIM architectural state at this commit
+};
+static size_t deferred_depth = 0;  // per-hart queue depth; 0 checks inline
+static std::vector<spsc_queue_t<commit_record_t>*> hart_commits;
+static std::thread*           check_worker = NULL;
+static std::atomic<bool>      check_worker_run(false);
+static std::atomic<int>       mismatch_seen(0);
+static std::atomic<long long> first_mismatch(-1);
+static void check_worker_loop();
+
+// Word layout of the packed state array used by getArchState/setArchState.
+enum
+{
+  ARCH_STATE_PC      = 0,
+  ARCH_STATE_XPR     = 1,
+  ARCH_STATE_FPR     = ARCH_STATE_XPR + NXPR,
+  ARCH_STATE_SR      = ARCH_STATE_FPR + NFPR,
+  ARCH_STATE_EPC,
+  ARCH_STATE_EVEC,
+  ARCH_STATE_PTBR,
+  ARCH_STATE_COUNT,
+  ARCH_STATE_COMPARE,
+  ARCH_STATE_FFLAGS,
+  ARCH_STATE_FRM,
+  ARCH_STATE_ASID,
+  ARCH_STATE_WORDS
+};
+
+// Pointer to element i of a 1-D open array passed in from the RTL.
+// Open arrays may be declared with any range, so index from svLow().
+#define SV_ELEM(type, h, i) ((type*)svGetArrElemPtr1(h, svLow(h, 1) + (i)))
+
+// Whether 'hart' names a core of the DPI SIM. The hart index comes from
+// the RTL, so a bad one is reported instead of indexing past the per-hart
+// tables.
+static bool valid_hart(int hart, const char* func)
+{
+  if (likely(hart >= 0 && (size_t)hart < s_dpi->num_cores()))
+    return true;
+  fprintf(stderr, "%s: hart %d out of range (%zu harts)\n", func, hart, s_dpi->num_cores());
+  return false;
+}
+
+// Access sizes accepted by the batched load/store interface. A lane with
+// any other size gets an access fault instead of stopping the simulation.
+static inline bool valid_lane_size(int size)
+{
+  return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+// An architectural state array from the RTL must hold every word of the
+// layout above; a short one is reported and left alone.
+static bool valid_arch_state(const svOpenArrayHandle arch_state, const char* func)
+{
+  int words = svLength(arch_state, 1);
+  if (likely(words >= ARCH_STATE_WORDS))
+    return true;
+  fprintf(stderr, "%s: state array has %d words, %d needed\n", func, words, (int)ARCH_STATE_WORDS);
+  return false;
+}
 
 extern "C" {
 
@@ -95,6 +200,29 @@ extern "C" {
     parser.option(0, "dc", 1, [&](const char* s){dc.reset(new dcache_sim_t(s));});
     parser.option(0, "l2", 1, [&](const char* s){l2.reset(cache_sim_t::construct(s, "L2$"));});
     parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
+    parser.option(0, "sync-checker", 0, [&](const char* s){sync_checker = true;});
+    parser.option(0, "deferred-check", 1, [&](const char* s){deferred_depth = atoll(s);});
+    parser.option(0, "trace", 1, [&](const char* s){trace_file = s;});
+    parser.option(0, "jit", 0, [&](const char* s){jit = true;});
+    parser.option(0, "fuse", 0, [&](const char* s){fuse = true;});
+    parser.option(0, "lazy-restore", 0, [&](const char* s){lazy_restore = true;});
+    parser.option(0, "chkpt-store", 1, [&](const char* s){chkpt_store = s;});
+    parser.option(0, "decode-cache", 1, [&](const char* s){
+      const char* wp = strchr(s, ':');
+      if (!wp++) help();
+      decode_cache_entries = atoi(std::string(s, wp).c_str());
+      decode_cache_ways = atoi(wp);
+      if (!mmu_t::valid_geometry(decode_cache_entries, decode_cache_ways, mmu_t::ICACHE_MAX_WAYS))
+        help();
+    });
+    parser.option(0, "tlb", 1, [&](const char* s){
+      const char* wp = strchr(s, ':');
+      if (!wp++) help();
+      tlb_entries = atoi(std::string(s, wp).c_str());
+      tlb_ways = atoi(wp);
+      if (!mmu_t::valid_geometry(tlb_entries, tlb_ways, mmu_t::TLB_MAX_WAYS))
+        help();
+    });
     parser.option(0, "extlib", 1, [&](const char *s){
       void *lib = dlopen(s, RTLD_NOW | RTLD_GLOBAL);
       if (lib == NULL) {
@@ -114,6 +242,9 @@ extern "C" {
       help();
   
 
+    if (trace_file && !trace_open(trace_file))
+      exit(-1);
+
     // Turn on logging if user requested logging from the start.
     // This way even run_ahead instructions will be logged.
     if(logging_on_at == -1)
@@ -125,6 +256,13 @@ extern "C" {
     s_dpi = new sim_t(nprocs, mem_mb, htif_args, DPI_SIM);
 
     ifprintf(logging_on,stderr,"Instantiated MICRO simulator\n");
+
+    for (size_t i = 0; i < s_dpi->num_cores(); i++)
+    {
+      hart_sim.push_back((dpisim_t*)(s_dpi->get_core(i)));
+      hart_mmu.push_back(s_dpi->get_core(i)->get_mmu());
+    }
+    hart_arch_pc.resize(s_dpi->num_cores());
   
     if (ic && l2) ic->set_miss_handler(&*l2);
     if (dc && l2) dc->set_miss_handler(&*l2);
@@ -138,18 +276,38 @@ extern "C" {
 
     s_dpi->set_debug(debug);
     s_dpi->set_histogram(histogram);
+    s_dpi->set_jit(jit);
+    s_dpi->set_fusion(fuse);
+    s_dpi->set_lazy_restore(lazy_restore);
+    if (chkpt_store)
+      s_dpi->set_checkpoint_store(chkpt_store);
+    if (decode_cache_entries)
+      s_dpi->set_decode_cache(decode_cache_entries, decode_cache_ways);
+    if (tlb_entries)
+      s_dpi->set_tlb(tlb_entries, tlb_ways);
   
     #ifdef RISCV_MICRO_CHECKER
       s_isa = new sim_t(nprocs, mem_mb, htif_args, ISA_SIM);
+      s_isa->set_jit(jit);
+      s_isa->set_fusion(fuse);
+      s_isa->set_lazy_restore(lazy_restore);
+      if (chkpt_store)
+        s_isa->set_checkpoint_store(chkpt_store);
+      if (decode_cache_entries)
+        s_isa->set_decode_cache(decode_cache_entries, decode_cache_ways);
+      if (tlb_entries)
+        s_isa->set_tlb(tlb_entries, tlb_ways);
       ifprintf(logging_on,stderr,"Instantiated ISA simulator\n");
 
-      Pipe = new debug_buffer_t(PIPE_QUEUE_SIZE);
+      for (size_t i = 0; i < s_dpi->num_cores(); i++)
+      {
+        debug_buffer_t* pipe = new debug_buffer_t(PIPE_QUEUE_SIZE, i);
+        pipe->set_isa_sim(s_isa);
+        s_isa->set_proc_pipe(i, pipe);
+        s_dpi->set_proc_pipe(i, pipe);
+        hart_pipe.push_back(pipe);
+      }
       ifprintf(logging_on,stderr,"Instantiated PIPE\n");
-  
-      Pipe->set_isa_sim(s_isa);
-  
-      s_isa->set_procs_pipe(Pipe);
-      s_dpi->set_procs_pipe(Pipe);
     #endif
   
     int i, exit_code, exec_index;
@@ -197,8 +355,23 @@ extern "C" {
           htif_code = s_isa->run_fast(skip_amt);
       }
   
-      // Fill the debug buffer
-      htif_code = Pipe->run_ahead();
+      // Fill the debug buffers
+      for (size_t i = 0; i < hart_pipe.size(); i++)
+        htif_code = hart_pipe[i]->run_ahead();
+
+      // Keep the debug buffer filled from a separate thread. With more than
+      // one hart the ISA sim cores share HTIF, so they stay synchronous.
+      if (!sync_checker && s_isa->num_cores() == 1)
+        hart_pipe[0]->start_producer();
+
+      if (deferred_depth)
+      {
+        for (size_t i = 0; i < hart_pipe.size(); i++)
+          hart_commits.push_back(new spsc_queue_t<commit_record_t>(deferred_depth));
+        check_worker_run = true;
+        check_worker = new std::thread(check_worker_loop);
+        ifprintf(logging_on,stderr,"Started deferred checker thread\n");
+      }
     #endif
   
   
@@ -231,7 +404,8 @@ extern "C" {
       logging_on = true;
 
     // Initialize the arch_pc to the architectural PC after skipping
-    arch_pc = ((dpisim_t*)(s_dpi->get_core(0)))->get_pc();
+    for (size_t i = 0; i < hart_sim.size(); i++)
+      hart_arch_pc[i] = hart_sim[i]->get_pc();
   
     ifprintf(logging_on,stderr, "Starting DPI SIM\n");
 
@@ -241,196 +415,478 @@ extern "C" {
 
 
 
-  long long getArchRegValue(int reg_id)
+  long long getArchRegValueHart(int hart, int reg_id)
   {
+    if (!valid_hart(hart, __func__))
+      return 0;
   
-    ifprintf(logging_on,stderr, "Architecture Reg Value: %u -> 0x%lX\n",reg_id, ((dpisim_t*)(s_dpi->get_core(0)))->get_arch_reg_value(reg_id));
-    return(((dpisim_t*)(s_dpi->get_core(0)))->get_arch_reg_value(reg_id));
+    TRACE(TE_ARCH_REG, hart, reg_id, hart_sim[hart]->get_arch_reg_value(reg_id), 0, 0);
+    return(hart_sim[hart]->get_arch_reg_value(reg_id));
   
   }
 
+  long long getArchRegValue(int reg_id)
+  {
+    return getArchRegValueHart(0, reg_id);
+  }
 
-  long long getArchPC()
+
+  long long getArchPCHart(int hart)
   {
+    if (!valid_hart(hart, __func__))
+      return 0;
   
-    ifprintf(logging_on,stderr, "Architecture PC is: 0x%lX\n",((dpisim_t*)(s_dpi->get_core(0)))->get_pc());
-    return(((dpisim_t*)(s_dpi->get_core(0)))->get_pc());
+    TRACE(TE_ARCH_PC, hart, 0, hart_sim[hart]->get_pc(), 0, 0);
+    return(hart_sim[hart]->get_pc());
   
   }
 
+  long long getArchPC()
+  {
+    return getArchPCHart(0);
+  }
+
   
-  int getInstruction(long long inst_pc, int* exception)
+  int getInstructionHart(int hart, long long inst_pc, int* exception)
   {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_FETCH;
+      return 0;
+    }
     //printf("I am in getInstruction\n");
     //ifprintf(logging_on,stderr, "Instruction PC is: 0x%llX\n",inst_pc);
     *exception = 0;
-    int instruction = 0;
-    try{
-      instruction = ((dpisim_t*)(s_dpi->get_core(0)))->get_instruction(inst_pc);
-    }
-	  catch(trap_t& t) {
-      ifprintf(logging_on, stderr, "Instruction Fetch Exception vaddr: 0x%llX cause: %lu\n",inst_pc,t.cause());
-      *exception = t.cause();
+    uint32_t instruction = 0;
+    reg_t cause;
+    if (!hart_sim[hart]->get_instruction(inst_pc, &instruction, &cause)) {
+      TRACE(TE_FETCH_EXCEPTION, hart, 0, inst_pc, cause, 0);
+      *exception = cause;
     }
     return instruction;
   }
 
+  int getInstruction(long long inst_pc, int* exception)
+  {
+    return getInstructionHart(0, inst_pc, exception);
+  }
+
+  // Fetch a whole bundle of up to 'width' (at most FETCH_WIDTH and
+  // FETCH_BUNDLE_MAX) sequential instructions in one call, with predecode
+  // information for each slot: the F_* flags, the fu_type, the rd/rs1/rs2
+  // fields and the fetch fault cause. The bundle ends after the first
+  // faulting slot. Returns the number of slots filled.
+  int getFetchBundleHart(int hart, long long pc, int width,
+                         const svOpenArrayHandle insn, const svOpenArrayHandle flags,
+                         const svOpenArrayHandle fu, const svOpenArrayHandle rd,
+                         const svOpenArrayHandle rs1, const svOpenArrayHandle rs2,
+                         const svOpenArrayHandle exception)
+  {
+    if (!valid_hart(hart, __func__))
+      return 0;
+    width = std::min(width, (int)FETCH_WIDTH);
+    width = std::min(width, FETCH_BUNDLE_MAX);
+    width = std::min(width, svLength(insn, 1));
+    if (width <= 0)
+      return 0;
+    fetch_slot_t slots[FETCH_BUNDLE_MAX];
 
-  long long loadDouble(long long cycle, long long ld_addr, int* exception)
+    int n = hart_sim[hart]->get_fetch_bundle(pc, width, slots);
+    for (int i = 0; i < n; i++)
+    {
+      *SV_ELEM(int, insn, i)      = slots[i].insn;
+      *SV_ELEM(int, flags, i)     = slots[i].flags;
+      *SV_ELEM(int, fu, i)        = slots[i].fu;
+      *SV_ELEM(int, rd, i)        = slots[i].rd;
+      *SV_ELEM(int, rs1, i)       = slots[i].rs1;
+      *SV_ELEM(int, rs2, i)       = slots[i].rs2;
+      *SV_ELEM(int, exception, i) = slots[i].cause;
+      if (slots[i].cause)
+        TRACE(TE_FETCH_EXCEPTION, hart, 0, slots[i].pc, slots[i].cause, 0);
+    }
+    return n;
+  }
+
+  int getFetchBundle(long long pc, int width,
+                     const svOpenArrayHandle insn, const svOpenArrayHandle flags,
+                     const svOpenArrayHandle fu, const svOpenArrayHandle rd,
+                     const svOpenArrayHandle rs1, const svOpenArrayHandle rs2,
+                     const svOpenArrayHandle exception)
   {
-    *exception = 0;
-    long long ld_data = 0;
-    try{
-      ld_data = (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->load_uint64(ld_addr);
+    return getFetchBundleHart(0, pc, width, insn, flags, fu, rd, rs1, rs2, exception);
+  }
+
+
+  long long loadDoubleHart(int hart, long long cycle, long long ld_addr, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_LOAD;
+      return 0;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Load Exception vaddr: 0x%llX cause: %lu\n",ld_addr,t.cause());
-      *exception = t.cause();
+    *exception = 0;
+    uint64_t ld_data = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_load(ld_addr, 8, &ld_data, &cause))
+    {
+      TRACE(TE_LOAD_EXCEPTION, hart, 0, ld_addr, cause, 0);
+      *exception = cause;
     }
-    ifprintf(logging_on,stderr, "Cycle: %lld Load addr is: 0x%llX data is: 0x%llX Exception: %d\n",cycle,ld_addr,ld_data,*exception);
+    TRACE(TE_LOAD_CYCLE, hart, *exception, cycle, ld_addr, ld_data);
     return ld_data;
   }
 
-  long long loadWord(long long ld_addr, int* exception)
+  long long loadDouble(long long cycle, long long ld_addr, int* exception)
+  {
+    return loadDoubleHart(0, cycle, ld_addr, exception);
+  }
+
+  long long loadWordHart(int hart, long long ld_addr, int* exception)
   {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_LOAD;
+      return 0;
+    }
     //printf("I am in loadWord\n");
-    ifprintf(logging_on,stderr, "Load addr is: 0x%llX\n",ld_addr);
+    TRACE(TE_LOAD, hart, 0, ld_addr, 0, 0);
     *exception = 0;
-    long long ld_data = 0;
-    try{
-      ld_data = (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->load_uint64(ld_addr);
+    uint64_t ld_data = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_load(ld_addr, 8, &ld_data, &cause))
+    {
+      TRACE(TE_LOAD_EXCEPTION, hart, 0, ld_addr, cause, 0);
+      *exception = cause;
+    }
+    return ld_data;
+  }
+
+  long long loadWord(long long ld_addr, int* exception)
+  {
+    return loadWordHart(0, ld_addr, exception);
+  }
+
+  long long loadHalfHart(int hart, long long ld_addr, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_LOAD;
+      return 0;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Load Exception vaddr: 0x%llX cause: %lu\n",ld_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_LOAD, hart, 0, ld_addr, 0, 0);
+    *exception = 0;
+    uint64_t ld_data = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_load(ld_addr, 8, &ld_data, &cause))
+    {
+      TRACE(TE_LOAD_EXCEPTION, hart, 0, ld_addr, cause, 0);
+      *exception = cause;
     }
     return ld_data;
   }
 
   long long loadHalf(long long ld_addr, int* exception)
   {
-    ifprintf(logging_on,stderr, "Load addr is: 0x%llX\n",ld_addr);
-    *exception = 0;
-    long long ld_data = 0;
-    try{
-      ld_data = (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->load_uint64(ld_addr);
+    return loadHalfHart(0, ld_addr, exception);
+  }
+
+  long long loadByteHart(int hart, long long ld_addr, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_LOAD;
+      return 0;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Load Exception vaddr: 0x%llX cause: %lu\n",ld_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_LOAD, hart, 0, ld_addr, 0, 0);
+    *exception = 0;
+    uint64_t ld_data = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_load(ld_addr, 8, &ld_data, &cause))
+    {
+      TRACE(TE_LOAD_EXCEPTION, hart, 0, ld_addr, cause, 0);
+      *exception = cause;
     }
     return ld_data;
   }
 
   long long loadByte(long long ld_addr, int* exception)
   {
-    ifprintf(logging_on,stderr, "Load addr is: 0x%llX\n",ld_addr);
-    *exception = 0;
-    long long ld_data = 0;
-    try{
-      ld_data = (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->load_uint64(ld_addr);
+    return loadByteHart(0, ld_addr, exception);
+  }
+ 
+  void storeDoubleHart(int hart, long long st_addr, long long st_data, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_STORE;
+      return;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Load Exception vaddr: 0x%llX cause: %lu\n",ld_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_STORE, hart, 0, st_addr, st_data, 0);
+    *exception = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_store(st_addr, 8, st_data, &cause))
+    {
+      TRACE(TE_STORE_EXCEPTION, hart, 0, st_addr, cause, 0);
+      *exception = cause;
     }
-    return ld_data;
   }
- 
+
   void storeDouble(long long st_addr, long long st_data, int* exception)
   {
-    ifprintf(logging_on,stderr, "Store addr is: 0x%llX and store data is: 0x%llX\n",st_addr,st_data);
-    *exception = 0;
-    try{
-      (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->store_uint64(st_addr,st_data);
+    storeDoubleHart(0, st_addr, st_data, exception);
+  }
+
+  void storeWordHart(int hart, long long st_addr, long long st_data, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_STORE;
+      return;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Store Exception vaddr: 0x%llX cause: %lu\n",st_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_STORE, hart, 0, st_addr, st_data, 0);
+    *exception = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_store(st_addr, 4, st_data, &cause))
+    {
+      TRACE(TE_STORE_EXCEPTION, hart, 0, st_addr, cause, 0);
+      *exception = cause;
     }
   }
 
   void storeWord(long long st_addr, long long st_data, int* exception)
   {
-    ifprintf(logging_on,stderr, "Store addr is: 0x%llX and store data is: 0x%llX\n",st_addr,st_data);
-    *exception = 0;
-    try{
-      (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->store_uint32(st_addr,st_data);
+    storeWordHart(0, st_addr, st_data, exception);
+  }
+
+  void storeHalfHart(int hart, long long st_addr, long long st_data, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_STORE;
+      return;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Store Exception vaddr: 0x%llX cause: %lu\n",st_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_STORE, hart, 0, st_addr, st_data, 0);
+    *exception = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_store(st_addr, 2, st_data, &cause))
+    {
+      TRACE(TE_STORE_EXCEPTION, hart, 0, st_addr, cause, 0);
+      *exception = cause;
     }
   }
 
   void storeHalf(long long st_addr, long long st_data, int* exception)
   {
-    ifprintf(logging_on, stderr, "Store addr is: 0x%llX and store data is: 0x%llX\n",st_addr,st_data);
-    *exception = 0;
-    try{
-      (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->store_uint16(st_addr,st_data);
+    storeHalfHart(0, st_addr, st_data, exception);
+  }
+
+  void storeByteHart(int hart, long long cycle, long long st_addr, long long st_data, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_STORE;
+      return;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Store Exception vaddr: 0x%llX cause: %lu\n",st_addr,t.cause());
-      *exception = t.cause();
+    TRACE(TE_STORE_CYCLE, hart, 0, cycle, st_addr, st_data);
+    *exception = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_store(st_addr, 1, st_data, &cause))
+    {
+      TRACE(TE_STORE_EXCEPTION_CYCLE, hart, 0, cycle, st_addr, cause);
+      *exception = cause;
     }
   }
 
   void storeByte(long long cycle, long long st_addr, long long st_data, int* exception)
   {
-    ifprintf(logging_on, stderr, "Cycle %lld: Store addr is: 0x%llX and store data is: 0x%llX\n",cycle,st_addr,st_data);
-    *exception = 0;
-    try{
-      (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->store_uint8(st_addr,st_data);
+    storeByteHart(0, cycle, st_addr, st_data, exception);
+  }
+
+  // Batched load/store interface for wide LSUs. One call services all the
+  // memory accesses of a cycle instead of one DPI call per access.
+  // All arrays must be the same length; a lane with size 0 is idle and
+  // is skipped. Sizes are in bytes (1, 2, 4 or 8); a lane with any other
+  // size gets an access fault. Per-lane exception codes are written to
+  // exception[] and the number of excepting lanes is returned, or -1 if
+  // 'hart' is out of range.
+  int loadBatchHart(int hart, long long cycle, const svOpenArrayHandle ld_addr, const svOpenArrayHandle ld_size,
+                    const svOpenArrayHandle ld_data, const svOpenArrayHandle exception)
+  {
+    if (!valid_hart(hart, __func__))
+      return -1;
+    mmu_t* mmu = hart_mmu[hart];
+    int lanes = svLength(ld_addr, 1);
+    int num_exceptions = 0;
+
+    for (int i = 0; i < lanes; i++)
+    {
+      long long addr = *SV_ELEM(long long, ld_addr, i);
+      int size = *SV_ELEM(int, ld_size, i);
+      long long* data = SV_ELEM(long long, ld_data, i);
+      int* cause = SV_ELEM(int, exception, i);
+
+      *data = 0;
+      *cause = 0;
+      if (!size)
+        continue;
+      reg_t trap_cause = CAUSE_FAULT_LOAD;
+      if (!valid_lane_size(size) || !mmu->try_load(addr, size, (uint64_t*)data, &trap_cause))
+      {
+        TRACE(TE_LOAD_LANE_EXCEPTION, hart, i, cycle, addr, trap_cause);
+        *cause = trap_cause;
+        num_exceptions++;
+      }
+      TRACE(TE_LOAD_LANE, hart, i | (size << 8) | (*cause << 16), cycle, addr, *data);
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Cycle %lld: Store Exception vaddr: 0x%llX cause: %lu\n",cycle,st_addr,t.cause());
-      *exception = t.cause();
+    return num_exceptions;
+  }
+
+  int loadBatch(long long cycle, const svOpenArrayHandle ld_addr, const svOpenArrayHandle ld_size,
+                const svOpenArrayHandle ld_data, const svOpenArrayHandle exception)
+  {
+    return loadBatchHart(0, cycle, ld_addr, ld_size, ld_data, exception);
+  }
+
+  int storeBatchHart(int hart, long long cycle, const svOpenArrayHandle st_addr, const svOpenArrayHandle st_size,
+                     const svOpenArrayHandle st_data, const svOpenArrayHandle exception)
+  {
+    if (!valid_hart(hart, __func__))
+      return -1;
+    mmu_t* mmu = hart_mmu[hart];
+    int lanes = svLength(st_addr, 1);
+    int num_exceptions = 0;
+
+    for (int i = 0; i < lanes; i++)
+    {
+      long long addr = *SV_ELEM(long long, st_addr, i);
+      int size = *SV_ELEM(int, st_size, i);
+      long long data = *SV_ELEM(long long, st_data, i);
+      int* cause = SV_ELEM(int, exception, i);
+
+      *cause = 0;
+      if (!size)
+        continue;
+      TRACE(TE_STORE_LANE, hart, i | (size << 8), cycle, addr, data);
+      reg_t trap_cause = CAUSE_FAULT_STORE;
+      if (!valid_lane_size(size) || !mmu->try_store(addr, size, data, &trap_cause))
+      {
+        TRACE(TE_STORE_LANE_EXCEPTION, hart, i, cycle, addr, trap_cause);
+        *cause = trap_cause;
+        num_exceptions++;
+      }
     }
+    return num_exceptions;
   }
 
-  long long dumpDouble(long long addr, int* exception)
+  int storeBatch(long long cycle, const svOpenArrayHandle st_addr, const svOpenArrayHandle st_size,
+                 const svOpenArrayHandle st_data, const svOpenArrayHandle exception)
   {
-    long long data = 0;
-    *exception = 0;
-    try{
-      data = (((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->load_uint64(addr);
+    return storeBatchHart(0, cycle, st_addr, st_size, st_data, exception);
+  }
+
+  long long dumpDoubleHart(int hart, long long addr, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = CAUSE_FAULT_LOAD;
+      return 0;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Dump Exception vaddr: 0x%llX cause: %lu\n",addr,t.cause());
-      *exception = t.cause();
+    uint64_t data = 0;
+    *exception = 0;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_load(addr, 8, &data, &cause))
+    {
+      ifprintf(logging_on, stderr, "Dump Exception vaddr: 0x%llX cause: %" PRIu64 "\n",addr,cause);
+      *exception = cause;
     }
-    ifprintf(logging_on,stderr, "Dump addr is: 0x%llX and data is: 0x%llX\n ",addr,data);
+    ifprintf(logging_on,stderr, "Dump addr is: 0x%llX and data is: 0x%" PRIX64 "\n ",addr,data);
     return data;
   }
 
+  long long dumpDouble(long long addr, int* exception)
+  {
+    return dumpDoubleHart(0, addr, exception);
+  }
+
 
-  long long virt_to_phys(long long virt_addr, int bytes, int store_access, int fetch_access, int* exception)
+  // Shared target-memory window. Returns the host address of the DPI SIM's
+  // physical memory and its size in bytes, so that a C memory model can
+  // read and write target memory directly instead of going through
+  // dumpDouble/loadDouble. Accesses through the window bypass the MMU:
+  // addresses are physical, and code written this way is not seen by
+  // the decoded-instruction cache until it is flushed.
+  void* getMemWindow(long long* mem_size)
+  {
+    *mem_size = s_dpi->get_memsz();
+    ifprintf(logging_on, stderr, "Memory window base: %p size: 0x%llX\n",s_dpi->get_mem_base(),*mem_size);
+    return s_dpi->get_mem_base();
+  }
+
+  // Bulk copies between physical memory and an open byte array for
+  // SystemVerilog models that cannot dereference the window directly.
+  // One call moves a whole cache line or preload block. A write flushes
+  // the decoded-instruction caches, so code it stores is fetched anew.
+  void readMemBlock(long long paddr, const svOpenArrayHandle data, int* exception)
   {
-    ifprintf(logging_on, stderr, "Translate vaddr: 0x%llX bytes: %d\n",virt_addr,bytes);
+    size_t bytes = svLength(data, 1);
     *exception = 0;
-    long long phy_addr  = 0;
-    try{
-      phy_addr = (long long)(((dpisim_t*)(s_dpi->get_core(0)))->get_mmu())->translate(virt_addr, bytes, store_access, fetch_access);
+    if (bytes == 0)
+      return;
+    if (paddr < 0 || paddr + bytes > s_dpi->get_memsz()) {
+      ifprintf(logging_on, stderr, "Memory window read out of range paddr: 0x%llX bytes: %lu\n",paddr,bytes);
+      *exception = CAUSE_FAULT_LOAD;
+      return;
     }
-    catch (mem_trap_t& t)
-	  {
-      ifprintf(logging_on, stderr, "Memory Access Exception vaddr: 0x%llX cause: %lu\n",virt_addr,t.cause());
-      *exception = t.cause();
+    memcpy(SV_ELEM(char, data, 0), s_dpi->get_mem_base() + paddr, bytes);
+  }
+
+  void writeMemBlock(long long paddr, const svOpenArrayHandle data, int* exception)
+  {
+    size_t bytes = svLength(data, 1);
+    *exception = 0;
+    if (bytes == 0)
+      return;
+    if (paddr < 0 || paddr + bytes > s_dpi->get_memsz()) {
+      ifprintf(logging_on, stderr, "Memory window write out of range paddr: 0x%llX bytes: %lu\n",paddr,bytes);
+      *exception = CAUSE_FAULT_STORE;
+      return;
     }
-    return phy_addr;
+    memcpy(s_dpi->get_mem_base() + paddr, SV_ELEM(char, data, 0), bytes);
+    for (size_t i = 0; i < hart_mmu.size(); i++)
+      hart_mmu[i]->flush_icache();
   }
 
-  int checkInstruction(long long v_cycle, long long v_commit, long long v_pc,int v_dest,long long v_dest_value, int is_fission)
+  long long virt_to_phys_hart(int hart, long long virt_addr, int bytes, int store_access, int fetch_access, int* exception)
+  {
+    if (!valid_hart(hart, __func__))
+    {
+      *exception = store_access ? CAUSE_FAULT_STORE : fetch_access ? CAUSE_FAULT_FETCH : CAUSE_FAULT_LOAD;
+      return 0;
+    }
+    TRACE(TE_TRANSLATE, hart, bytes, virt_addr, 0, 0);
+    *exception = 0;
+    void* phy_addr = NULL;
+    reg_t cause;
+    if (!hart_mmu[hart]->try_translate(virt_addr, bytes, store_access, fetch_access, &phy_addr, &cause))
+    {
+      TRACE(TE_TRANSLATE_EXCEPTION, hart, 0, virt_addr, cause, 0);
+      *exception = cause;
+    }
+    return (long long)phy_addr;
+  }
+
+  long long virt_to_phys(long long virt_addr, int bytes, int store_access, int fetch_access, int* exception)
+  {
+    return virt_to_phys_hart(0, virt_addr, bytes, store_access, fetch_access, exception);
+  }
+
+  // Compare one committed instruction against the next debug buffer entry
+  // of 'hart'. 'dpi_state', 'sim_cycle' and 'sim_insn' are the DPI SIM state
+  // as of this commit, and 'disasm' prints a mismatch. Runs on the RTL
+  // thread, or on the checker thread in deferred mode; either way it does
+  // not read the DPI SIM core itself.
+  static int compare_commit(int hart, long long v_cycle, long long v_commit, long long v_pc,int v_dest,long long v_dest_value, int is_fission,
+                            state_t* dpi_state, cycle_t sim_cycle, uint64_t sim_insn, disassembler_t* disasm)
   {
 
     //printf("I am in checkInstruction\n");
@@ -440,7 +896,7 @@ extern "C" {
 
     db_t *actual;		// Pointer to corresponding instruction in the functional simulator.
 
-    ifprintf(logging_on, stderr, "Cycle %lld: Commit: %lld Checking instruction for PC 0x%llx\n",v_cycle,v_commit,v_pc);
+    TRACE(TE_CHECK, hart, 0, v_cycle, v_commit, v_pc);
     int check_passed = 1;
 
     long long fs_pc, fs_dest_value, fs_addr, fs_ld_data;
@@ -452,9 +908,9 @@ extern "C" {
       // Get pointer to the corresponding instruction in the functional simulator.
       // This enables checking results of the pipeline simulator.
       // arch_pc keeps track of the current architectural pc
-	    debug_index_t db_index = Pipe->first(arch_pc);
-	    actual = Pipe->pop(db_index);
-	    arch_pc = actual->a_next_pc;
+	    debug_index_t db_index = hart_pipe[hart]->first(hart_arch_pc[hart]);
+	    actual = hart_pipe[hart]->pop(db_index);
+	    hart_arch_pc[hart] = actual->a_next_pc;
       
     //printf("I am in checkInstruction\n");
       // Validate the instruction PC.
@@ -500,18 +956,129 @@ extern "C" {
         }
       } // HAS DESTINAITON
 
-      dpisim_t* dpi_sim = ((dpisim_t*)(s_dpi->get_core(0)));
+      dpisim_t* dpi_sim = hart_sim[hart];
       if(!check_passed)
-        Pipe->dump(dpi_sim, actual, stderr);
+        hart_pipe[hart]->dump(disasm, sim_cycle, actual, stderr);
 
-      check_passed = check_passed && !(dpi_sim->check_state(dpi_sim->get_state(),actual->a_state,actual));
+      check_passed = check_passed && !(dpi_sim->check_state(dpi_state,actual->a_state,actual,sim_cycle,sim_insn,disasm));
     }
     
     return check_passed;
   }
 
+  static void record_mismatch(long long v_commit)
+  {
+    long long none = -1;
+    first_mismatch.compare_exchange_strong(none, v_commit);
+    mismatch_seen.store(1, std::memory_order_release);
+  }
+
+  // Wait until the checker thread has compared every queued commit.
+  static void drain_commits()
+  {
+    for (size_t h = 0; h < hart_commits.size(); h++)
+      while (!hart_commits[h]->empty())
+        std::this_thread::yield();
+  }
+
+  int checkInstructionHart(int hart, long long v_cycle, long long v_commit, long long v_pc,int v_dest,long long v_dest_value, int is_fission)
+  {
+    if (!valid_hart(hart, __func__))
+      return 0;
+    dpisim_t* dpi_sim = hart_sim[hart];
+
+    if (!check_worker)
+      return compare_commit(hart, v_cycle, v_commit, v_pc, v_dest, v_dest_value, is_fission,
+                            dpi_sim->get_state(), dpi_sim->cycle, dpi_sim->num_insn, dpi_sim->get_disassembler());
+
+    // Deferred mode: fission halves carry nothing to check. Otherwise
+    // snapshot the commit and let the checker thread compare it; results
+    // are reported through pollChecker()/drainChecker().
+    if (is_fission)
+      return 1;
+
+    commit_record_t r;
+    r.cycle      = v_cycle;
+    r.commit     = v_commit;
+    r.pc         = v_pc;
+    r.dest       = v_dest;
+    r.dest_value = v_dest_value;
+    r.sim_cycle  = dpi_sim->cycle;
+    r.sim_insn   = dpi_sim->num_insn;
+    r.state      = *dpi_sim->get_state();
+    while (!hart_commits[hart]->push(r))
+      std::this_thread::yield();
+    return 1;
+  }
+
+  int checkInstruction(long long v_cycle, long long v_commit, long long v_pc,int v_dest,long long v_dest_value, int is_fission)
+  {
+    return checkInstructionHart(0, v_cycle, v_commit, v_pc, v_dest, v_dest_value, is_fission);
+  }
+
+  // Check a whole retire bundle in one DPI call. The first 'count' lanes of
+  // the open arrays hold the retired instructions in program order; lane i
+  // is checked as commit number v_commit+i. Returns a bitmask with bit i set
+  // if lane i failed, so at most 32 lanes can be checked per call; extra
+  // lanes are reported and left unchecked. A bad hart fails every lane.
+  int checkBundleHart(int hart, long long v_cycle, long long v_commit, int count,
+                      const svOpenArrayHandle v_pc, const svOpenArrayHandle v_dest,
+                      const svOpenArrayHandle v_dest_value, const svOpenArrayHandle is_fission)
+  {
+    if (!valid_hart(hart, __func__))
+      return -1;
+    int lanes = std::min(32, svLength(v_pc, 1));
+    if (count > lanes)
+    {
+      fprintf(stderr, "checkBundle: %d lanes requested, only %d checked\n", count, lanes);
+      count = lanes;
+    }
+    uint32_t fail_mask = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+      if (!checkInstructionHart(hart, v_cycle, v_commit + i,
+                                *SV_ELEM(long long, v_pc, i),
+                                *SV_ELEM(int, v_dest, i),
+                                *SV_ELEM(long long, v_dest_value, i),
+                                *SV_ELEM(int, is_fission, i)))
+        fail_mask |= (1u << i);
+    }
+    return fail_mask;
+  }
+
+  int checkBundle(long long v_cycle, long long v_commit, int count,
+                  const svOpenArrayHandle v_pc, const svOpenArrayHandle v_dest,
+                  const svOpenArrayHandle v_dest_value, const svOpenArrayHandle is_fission)
+  {
+    return checkBundleHart(0, v_cycle, v_commit, count, v_pc, v_dest, v_dest_value, is_fission);
+  }
+
+  // Deferred checking status, meant to be polled by the RTL every few
+  // cycles. Returns 1 once any queued commit has failed; 'first_fail_commit'
+  // gets the commit number of the first failure, or -1.
+  int pollChecker(long long* first_fail_commit)
+  {
+    *first_fail_commit = first_mismatch.load(std::memory_order_relaxed);
+    return mismatch_seen.load(std::memory_order_acquire);
+  }
+
+  // Same as pollChecker(), but first waits for all queued commits to be
+  // checked.
+  int drainChecker(long long* first_fail_commit)
+  {
+    drain_commits();
+    return pollChecker(first_fail_commit);
+  }
+
+  // Called by the RTL on a fixed schedule. Calls that find HTIF idle
+  // return without exchanging a packet with the host.
   int htif_tick(int* htif_ret)
   {
+    if (!s_dpi->htif_tick_due()) {
+      *htif_ret = 1;
+      return 0;
+    }
     int htif_code = (int)((s_dpi->get_htif())->tick());
     if(!htif_code){
       ifprintf(logging_on,stderr, "Simulation finished during HTIF tick\n");
@@ -519,15 +1086,24 @@ extern "C" {
     }
     // Check if simulation has completed
     if(!s_dpi->running()){
+      if (check_worker) {
+        drain_commits();
+        check_worker_run = false;
+        check_worker->join();
+        delete check_worker;
+        check_worker = NULL;
+      }
       end_rtl_simulation();
     }
     *htif_ret = htif_code;
     return 0;
   }
 
-  void set_interrupt(int which, bool on)
+  void set_interrupt_hart(int hart, int which, bool on)
   {
-    dpisim_t* sim = ((dpisim_t*)(s_dpi->get_core(0)));
+    if (!valid_hart(hart, __func__))
+      return;
+    dpisim_t* sim = hart_sim[hart];
     state_t* state = sim->get_state();
     uint32_t mask = (1 << (which + SR_IP_SHIFT)) & SR_IP;
     if (on){
@@ -538,17 +1114,24 @@ extern "C" {
     }
   }
 
+  void set_interrupt(int which, bool on)
+  {
+    set_interrupt_hart(0, which, on);
+  }
+
   int get_logging_mode()
   {
     return logging_on;
   }
 
 
-  void set_pcr(int which,long long val)
+  void set_pcr_hart(int hart, int which,long long val)
   {
+    if (!valid_hart(hart, __func__))
+      return;
 
-    ifprintf(logging_on, stderr, "Write CSR 0x%x ->  0x%llX\n",which,val);
-    dpisim_t* sim = ((dpisim_t*)(s_dpi->get_core(0)));
+    TRACE(TE_WRITE_CSR, hart, which, val, 0, 0);
+    dpisim_t* sim = hart_sim[hart];
     state_t* state = sim->get_state();
     reg_t rv64 = (state->sr & SR_S) ? (state->sr & SR_S64) : (state->sr & SR_U64);
   
@@ -577,7 +1160,7 @@ extern "C" {
           state->sr &= ~SR_EA;
         state->sr &= ~SR_ZERO;
         rv64 = (state->sr & SR_S) ? (state->sr & SR_S64) : (state->sr & SR_U64);
-        //mmu->flush_tlb();
+        hart_mmu[hart]->flush_tlb_untagged();
         break;
       case CSR_EPC:
         state->epc = val;
@@ -598,7 +1181,7 @@ extern "C" {
         break;
       case CSR_COMPARE:
         //serialize();
-        set_interrupt(IRQ_TIMER, false);
+        set_interrupt_hart(hart, IRQ_TIMER, false);
         state->compare = val;
         break;
       case CSR_CAUSE:
@@ -607,11 +1190,14 @@ extern "C" {
       case CSR_PTBR:
         state->ptbr = val & ~(PGSIZE-1);
         break;
+      case CSR_ASID:
+        hart_mmu[hart]->set_asid(val);
+        break;
       case CSR_SEND_IPI:
         s_dpi->send_ipi(val);
         break;
       case CSR_CLEAR_IPI:
-        set_interrupt(IRQ_IPI, val & 1);
+        set_interrupt_hart(hart, IRQ_IPI, val & 1);
         break;
       case CSR_SUP0:
         state->pcr_k0 = val;
@@ -626,17 +1212,24 @@ extern "C" {
       case CSR_FROMHOST:
         // When this is called by the RTL, it will always
         // be to clear the interrupt (i.e. val = 0).
-        set_interrupt(IRQ_HOST, val != 0);
+        set_interrupt_hart(hart, IRQ_HOST, val != 0);
         state->fromhost = val;
         break;
     }
   }
 
-  long long get_pcr(int which)
+  void set_pcr(int which,long long val)
+  {
+    set_pcr_hart(0, which, val);
+  }
+
+  long long get_pcr_hart(int hart, int which)
   {
+    if (!valid_hart(hart, __func__))
+      return 0;
 
-    ifprintf(logging_on, stderr, "Read CSR 0x%x\n",which);
-    dpisim_t* sim = ((dpisim_t*)(s_dpi->get_core(0)));
+    TRACE(TE_READ_CSR, hart, which, 0, 0, 0);
+    dpisim_t* sim = hart_sim[hart];
     state_t* state = sim->get_state();
     reg_t rv64 = (state->sr & SR_S) ? (state->sr & SR_S64) : (state->sr & SR_U64);
 
@@ -683,13 +1276,14 @@ extern "C" {
       case CSR_CLEAR_IPI:
         return 0;
       case CSR_ASID:
-        return 0;
+        return hart_mmu[hart]->get_asid();
       case CSR_FATC:
-        //mmu->flush_tlb();
+        // The RTL changed page tables, so the ASID-tagged second level
+        // and the walk cache go as well, as in processor_t::get_pcr().
+        hart_mmu[hart]->flush_tlb();
         return 0;
       case CSR_HARTID:
-        //return id;
-        return 0;
+        return hart;
       case CSR_IMPL:
         return 1;
       case CSR_SUP0:
@@ -723,4 +1317,109 @@ extern "C" {
     throw trap_illegal_instruction();
   }
 
+  long long get_pcr(int which)
+  {
+    return get_pcr_hart(0, which);
+  }
+
+  // Bulk architectural state transfer. The state travels as one packed
+  // array of 64-bit words laid out as ARCH_STATE_*, so that a resync
+  // after skip/restore is one DPI call instead of one per register.
+  void getArchStateHart(int hart, const svOpenArrayHandle arch_state)
+  {
+    if (!valid_hart(hart, __func__) || !valid_arch_state(arch_state, __func__))
+      return;
+    state_t* state = hart_sim[hart]->get_state();
+    long long* w = SV_ELEM(long long, arch_state, 0);
+
+    w[ARCH_STATE_PC] = state->pc;
+    for (int i = 0; i < NXPR; i++)
+      w[ARCH_STATE_XPR + i] = state->XPR[i];
+    for (int i = 0; i < NFPR; i++)
+      w[ARCH_STATE_FPR + i] = state->FPR[i];
+    w[ARCH_STATE_SR]      = state->sr;
+    w[ARCH_STATE_EPC]     = state->epc;
+    w[ARCH_STATE_EVEC]    = state->evec;
+    w[ARCH_STATE_PTBR]    = state->ptbr;
+    w[ARCH_STATE_COUNT]   = state->count;
+    w[ARCH_STATE_COMPARE] = state->compare;
+    w[ARCH_STATE_FFLAGS]  = state->fflags;
+    w[ARCH_STATE_FRM]     = state->frm;
+    w[ARCH_STATE_ASID]    = hart_mmu[hart]->get_asid();
+  }
+
+  void getArchState(const svOpenArrayHandle arch_state)
+  {
+    getArchStateHart(0, arch_state);
+  }
+
+  // The CSRs go through set_pcr_hart() so that the same masking and side
+  // effects apply as for a CSR write. The page table root and ASID are
+  // written before status, whose TLB and icache flush then drops
+  // translations made under the old ones.
+  void setArchStateHart(int hart, const svOpenArrayHandle arch_state)
+  {
+    if (!valid_hart(hart, __func__) || !valid_arch_state(arch_state, __func__))
+      return;
+    state_t* state = hart_sim[hart]->get_state();
+    long long* w = SV_ELEM(long long, arch_state, 0);
+
+    state->pc = w[ARCH_STATE_PC];
+    for (int i = 0; i < NXPR; i++)
+      state->XPR.write(i, w[ARCH_STATE_XPR + i]);
+    for (int i = 0; i < NFPR; i++)
+      state->FPR.write(i, w[ARCH_STATE_FPR + i]);
+    set_pcr_hart(hart, CSR_PTBR,    w[ARCH_STATE_PTBR]);
+    set_pcr_hart(hart, CSR_ASID,    w[ARCH_STATE_ASID]);
+    set_pcr_hart(hart, CSR_STATUS,  w[ARCH_STATE_SR]);
+    set_pcr_hart(hart, CSR_EPC,     w[ARCH_STATE_EPC]);
+    set_pcr_hart(hart, CSR_EVEC,    w[ARCH_STATE_EVEC]);
+    set_pcr_hart(hart, CSR_COUNT,   w[ARCH_STATE_COUNT]);
+    set_pcr_hart(hart, CSR_COMPARE, w[ARCH_STATE_COMPARE]);
+    set_pcr_hart(hart, CSR_FFLAGS,  w[ARCH_STATE_FFLAGS]);
+    set_pcr_hart(hart, CSR_FRM,     w[ARCH_STATE_FRM]);
+  }
+
+  void setArchState(const svOpenArrayHandle arch_state)
+  {
+    setArchStateHart(0, arch_state);
+  }
+
 } // extern "C"
+
+// Body of the deferred checker thread. A commit is popped only after it
+// has been compared, so an empty queue means everything has been checked.
+static void check_worker_loop()
+{
+  // Mismatches are disassembled with the thread's own disassemblers, since
+  // the RTL thread keeps using the cores'.
+  std::vector<disassembler_t*> disasm;
+  for (size_t h = 0; h < hart_commits.size(); h++)
+  {
+    disasm.push_back(new disassembler_t);
+    if (extension_t* ext = hart_sim[h]->get_extension())
+      for (auto disasm_insn : ext->get_disasms())
+        disasm[h]->add_insn(disasm_insn);
+  }
+
+  while (check_worker_run.load(std::memory_order_acquire))
+  {
+    bool idle = true;
+    for (size_t h = 0; h < hart_commits.size(); h++)
+    {
+      commit_record_t* r = hart_commits[h]->front();
+      if (!r)
+        continue;
+      if (!compare_commit(h, r->cycle, r->commit, r->pc, r->dest, r->dest_value, 0,
+                          &r->state, r->sim_cycle, r->sim_insn, disasm[h]))
+        record_mismatch(r->commit);
+      hart_commits[h]->pop();
+      idle = false;
+    }
+    if (idle)
+      std::this_thread::yield();
+  }
+
+  for (size_t h = 0; h < disasm.size(); h++)
+    delete disasm[h];
+}